@@ -36,6 +36,7 @@ export FLOATZONE_XED_INC_OBJ=$FLOATZONE_XED/obj/
 
 export WRAP_DIR=$FLOATZONE_TOP/runtime/ 
 export FLOATZONE_LIBWRAP_SO=$WRAP_DIR/libwrap.so
+export FLOATZONE_LIBCMP_SO=$WRAP_DIR/libcmp.so
 
 
 export FLOATZONE_INFRA=$FLOATZONE_TOP/instrumentation-infra/
@@ -29,6 +29,7 @@ TODO we do not intercept all libc functions, but we cover the most important:
 #define _GNU_SOURCE // for non-POSIX RTLD_NEXT
 #include <dlfcn.h>
 #include <stdint.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdio.h>
 #include <malloc.h>
@@ -38,12 +39,19 @@ TODO we do not intercept all libc functions, but we cover the most important:
 #include <stdlib.h>
 #include <execinfo.h>
 #include <immintrin.h>
+#include <cpuid.h>
 #include <setjmp.h>
 #include <execinfo.h>
 #include <wchar.h>
 #include <pthread.h>
 #include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#ifdef LIBXED_SO
 #include "xed-interface.h"
+#endif
 
 #define TARGET "run_base" // use "run_base" for SPEC
 #define JULIET "CWE"      // use "CWE" for Juliet
@@ -62,8 +70,13 @@ TODO we do not intercept all libc functions, but we cover the most important:
 
 // MODE: count exceptions handled
 #define COUNT_EXCEPTIONS 0
+// MODE: check with integer compares instead of vaddss, and leave the FPU
+// environment alone (cmp.c builds libcmp.so with it)
+#ifndef CHECK_CMP
+#define CHECK_CMP 0
+#endif
 // MODE: enable float underflow exceptions
-#define ENABLE_EXCEPTIONS 1
+#define ENABLE_EXCEPTIONS (CHECK_CMP == 0)
 // MODE: allow surviving exceptions (recover)
 #define SURVIVE_EXCEPTIONS 0
 // MODE: heap quarantine
@@ -72,9 +85,25 @@ TODO we do not intercept all libc functions, but we cover the most important:
 #define CATCH_SEGFAULT 0
 // MODE: AFL++ requires abort() for bugs
 #define FUZZ_MODE 0
-#define QUARANTINE_SIZE_BYTES 268435456 // 256 MB
+// MODE: evict the quarantine on a background thread
+#define ENABLE_DRAINER 0
+// MODE: serve small allocations from chunks evicted by the same thread
+#define ENABLE_RECYCLE 1
+#define QUARANTINE_SIZE_BYTES 268435456 // 256 MB, default of quarantine_bytes
+// drainer: allocating threads evict by themselves past this multiple of the budget
+#define QUARANTINE_BACKPRESSURE 2
+// quarantine_adaptive: lower bound, and PSI "some avg10" thresholds (1/100 %)
+#define QUARANTINE_ADAPT_MIN_BYTES 16777216 // 16 MB
+#define QUARANTINE_PSI_SHRINK 1000
+#define QUARANTINE_PSI_HOLD 100
+// quarantine_adaptive without drainer: frees between two clock reads
+#define QUARANTINE_ADAPT_TICKS 4096
 // quarantine max bytes / min. size of alloc == upper bound
-#define MIN_ALLOC_SIZE 40
+#define MIN_ALLOC_SIZE 56
+// requests from this size on are mapped by the runtime, not the backend
+#define LARGE_ALLOC_BYTES 1048576 // 1 MB
+// MODE: index the pages of heap payloads, for range checks in one lookup
+#define ENABLE_ALLOC_INDEX 1
 
 static uint8_t process = 0;
 
@@ -85,6 +114,157 @@ struct redzone {
   0x8b, 0x8b, 0x8b, 0x8b,
   0x8b, 0x8b, 0x8b, 0x8b}};
 
+// Heap chunk layout:
+//   [Header][underflow redzone][payload][overflow redzone][0x8b up to the usable size]
+// The header spares free() and realloc() a malloc_usable_size() call and a
+// scan of the poison for the end of the payload.
+typedef struct Header Header;
+struct Header {
+  uint64_t size;  // requested size
+  uint32_t slack; // usable size - CHUNK_PADDING - size
+  uint16_t flags; // CHUNK_*
+  uint16_t magic; // CHUNK_MAGIC
+};
+#define CHUNK_MAGIC 0xf10a
+#define CHUNK_SLAB 1 // slot of the slab allocator
+#define CHUNK_ALIGNED 2 // the backend chunk starts before the header, see aligned_malloc()
+#define CHUNK_MMAP 4 // own mapping of usable size bytes, see large_malloc()
+#define CHUNK_PLAIN 8 // unsampled: [Header][payload], see plain_malloc()
+#define CHUNK_PAYLOAD (sizeof(Header) + REDZONE_SIZE) // payload offset
+#define CHUNK_PADDING (CHUNK_PAYLOAD + REDZONE_SIZE)
+
+static inline Header* chunk_header(void* ptr)
+{
+  return (Header*)(((uint8_t*)ptr) - CHUNK_PAYLOAD);
+}
+
+static inline size_t chunk_usable(Header* h)
+{
+  return h->size + CHUNK_PADDING + h->slack;
+}
+
+static inline void set_header(void* ptr, size_t size, size_t slack)
+{
+  *chunk_header(ptr) = (Header){ size, slack, 0, CHUNK_MAGIC };
+}
+
+// backend chunk of an allocation, and its usable size
+static inline uint8_t* chunk_start(void* ptr, size_t* usable)
+{
+  Header* h = chunk_header(ptr);
+  uint8_t* chunk = (uint8_t*)h;
+
+  *usable = chunk_usable(h);
+  if(h->flags & CHUNK_ALIGNED){
+    uint8_t* start = ((uint8_t**)h)[-1];
+    *usable += chunk - start;
+    chunk = start;
+  }
+  return chunk;
+}
+
+// Allocation index: the header of the allocation around each page that
+// lies entirely within a payload, in two levels over the 47-bit user
+// address space. Leaves cover 1 GB each and are mapped on first use. The
+// allocation functions keep it up to date (lock-free), and the checks of
+// big ranges (see check_poison()) cost one lookup on heap memory instead
+// of a scan. Other memory, and payloads that do not span a whole page, are
+// not in it.
+#define INDEX_LEAF_BITS 18
+#define INDEX_ROOT_BITS (47 - 12 - INDEX_LEAF_BITS)
+
+static Header** index_root[1 << INDEX_ROOT_BITS];
+
+static Header** index_leaf(uintptr_t page)
+{
+  Header** leaf = __atomic_load_n(&index_root[page >> INDEX_LEAF_BITS], __ATOMIC_ACQUIRE);
+  if(leaf != NULL) return leaf;
+
+  leaf = mmap(NULL, sizeof(Header*) << INDEX_LEAF_BITS, PROT_READ|PROT_WRITE,
+              MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+  if(leaf == MAP_FAILED) return NULL;
+  Header** expected = NULL;
+  if(!__atomic_compare_exchange_n(&index_root[page >> INDEX_LEAF_BITS], &expected, leaf,
+                                  0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+    // another thread was first
+    munmap(leaf, sizeof(Header*) << INDEX_LEAF_BITS);
+    leaf = expected;
+  }
+  return leaf;
+}
+
+// set the pages of the payload at ptr to h (NULL: remove them)
+static void index_set(void* ptr, size_t size, Header* h)
+{
+  uintptr_t page = ((uintptr_t)ptr + 4095) >> 12;
+  uintptr_t end = ((uintptr_t)ptr + size) >> 12;
+
+  for(; page < end && (page >> (INDEX_ROOT_BITS + INDEX_LEAF_BITS)) == 0; page++){
+    Header** leaf = h != NULL ? index_leaf(page) : __atomic_load_n(&index_root[page >> INDEX_LEAF_BITS], __ATOMIC_ACQUIRE);
+    if(leaf == NULL) return;
+    __atomic_store_n(&leaf[page & ((1 << INDEX_LEAF_BITS) - 1)], h, __ATOMIC_RELEASE);
+  }
+}
+
+static inline void index_add(void* ptr, size_t size)
+{
+#if ENABLE_ALLOC_INDEX == 1
+  if(size >= 4096) index_set(ptr, size, chunk_header(ptr));
+#endif
+}
+
+static inline void index_remove(void* ptr, size_t size)
+{
+#if ENABLE_ALLOC_INDEX == 1
+  if(size >= 4096) index_set(ptr, size, NULL);
+#endif
+}
+
+// The inaccessible pages of quarantined chunks (see poison_chunk()) are
+// in the index too, as the chunk's address with this bit set, so that a
+// SIGSEGV on them can be told apart from the program's own
+#define INDEX_FREED 1
+
+static inline Header* index_entry(uintptr_t page)
+{
+  if((page >> (INDEX_ROOT_BITS + INDEX_LEAF_BITS)) != 0) return NULL;
+  Header** leaf = __atomic_load_n(&index_root[page >> INDEX_LEAF_BITS], __ATOMIC_ACQUIRE);
+  if(leaf == NULL) return NULL;
+  return __atomic_load_n(&leaf[page & ((1 << INDEX_LEAF_BITS) - 1)], __ATOMIC_ACQUIRE);
+}
+
+// the allocation around a page (number), if any
+static inline Header* index_page(uintptr_t page)
+{
+  Header* h = index_entry(page);
+  return ((uintptr_t)h & INDEX_FREED) ? NULL : h;
+}
+
+// the quarantined chunk whose inaccessible pages include this one, if any
+static inline uint8_t* index_freed(uintptr_t page)
+{
+  uintptr_t e = (uintptr_t)index_entry(page);
+  return (e & INDEX_FREED) ? (uint8_t*)(e & ~(uintptr_t)INDEX_FREED) : NULL;
+}
+
+// [p, p + size) lies within a single payload, found through the first
+// whole page of the range
+static inline int index_covers(void* p, size_t size)
+{
+#if ENABLE_ALLOC_INDEX == 1
+  uintptr_t page = ((uintptr_t)p + 4095) >> 12;
+  if(((page + 1) << 12) - (uintptr_t)p > size) return 0;
+
+  Header* h = index_page(page);
+  if(h == NULL) return 0;
+
+  uint8_t* payload = (uint8_t*)h + CHUNK_PAYLOAD;
+  return (uint8_t*)p >= payload && (uint8_t*)p + size <= payload + h->size;
+#else
+  return 0;
+#endif
+}
+
 
 #if COUNT_EXCEPTIONS == 1
 static uint32_t except_cnt_vaddss_skip = 0; // FP from vaddss but no redzone
@@ -101,7 +281,402 @@ void* __libc_malloc(size_t size);
 void* __libc_calloc(size_t nmemb, size_t size);
 void* __libc_realloc(void* ptr, size_t size);
 void* __libc_free(void* ptr);
+void* __libc_memalign(size_t alignment, size_t size);
+void* __libc_valloc(size_t size);
+void* __libc_pvalloc(size_t size);
+
+// Backend allocator under the redzone layer (FLOATZONE_OPTIONS backend=...):
+// glibc, or jemalloc/mimalloc/tcmalloc loaded at startup. sized_free and
+// good_size are only set when the backend has them.
+typedef struct Backend Backend;
+struct Backend {
+  const char *name;
+  void* (*malloc)(size_t size);
+  void* (*calloc)(size_t nmemb, size_t size);
+  void* (*realloc)(void* ptr, size_t size);
+  void (*free)(void* ptr);
+  size_t (*usable_size)(void* ptr);
+  void (*sized_free)(void* ptr, size_t size); // size: up to the usable size
+  size_t (*good_size)(size_t size);           // usable size for a request
+  int glibc;
+};
+
+static void glibc_free(void* ptr)
+{
+  __libc_free(ptr);
+}
+
+static size_t glibc_good_size(size_t size)
+{
+  // chunk of size + 8, aligned to 16, minus the size field
+  if(size + 8 < 32) return 24;
+  return ((size + 8 + 15) & ~(size_t)15) - 8;
+}
+
+static Backend backend = {
+  "glibc", __libc_malloc, __libc_calloc, __libc_realloc, glibc_free,
+  malloc_usable_size, NULL, glibc_good_size, 1
+};
+static char backend_name[16] = "glibc";
+
+// the jemalloc/tcmalloc flavours take an extra `flags` argument
+static void (*backend_sized_free_flags)(void* ptr, size_t size, int flags);
+static size_t (*backend_good_size_flags)(size_t size, int flags);
+
+static void sized_free_no_flags(void* ptr, size_t size)
+{
+  backend_sized_free_flags(ptr, size, 0);
+}
+
+static size_t good_size_no_flags(size_t size)
+{
+  return backend_good_size_flags(size, 0);
+}
+
+#define BACKEND_SIZED_FREE_FLAGS 1
+#define BACKEND_GOOD_SIZE_FLAGS 2
+
+typedef struct BackendLib BackendLib;
+struct BackendLib {
+  const char *name;
+  const char *sonames[2];
+  // malloc, calloc, realloc, free, usable_size, sized_free, good_size
+  const char *syms[7];
+  int flags;
+};
+
+static const BackendLib backend_libs[] = {
+  { "jemalloc", { "libjemalloc.so.2", "libjemalloc.so" },
+    { "malloc", "calloc", "realloc", "free", "malloc_usable_size", "sdallocx", "nallocx" },
+    BACKEND_SIZED_FREE_FLAGS|BACKEND_GOOD_SIZE_FLAGS },
+  { "mimalloc", { "libmimalloc.so.2", "libmimalloc.so" },
+    { "mi_malloc", "mi_calloc", "mi_realloc", "mi_free", "mi_usable_size", "mi_free_size", "mi_good_size" },
+    0 },
+  { "tcmalloc", { "libtcmalloc_minimal.so.4", "libtcmalloc.so.4" },
+    { "tc_malloc", "tc_calloc", "tc_realloc", "tc_free", "tc_malloc_size", "tc_free_sized", "tc_nallocx" },
+    BACKEND_GOOD_SIZE_FLAGS },
+};
+
+static int backend_load(const BackendLib *lib)
+{
+  void *handle = NULL;
+  void *sym[7];
+
+  // RTLD_LOCAL: its malloc must not take over the process
+  for(int i = 0; i < 2 && handle == NULL; i++){
+    handle = dlopen(lib->sonames[i], RTLD_NOW|RTLD_LOCAL);
+  }
+  if(handle == NULL) return 0;
+  for(int i = 0; i < 7; i++){
+    sym[i] = dlsym(handle, lib->syms[i]);
+    if(sym[i] == NULL && i < 5) return 0;
+  }
+
+  Backend be = { lib->name, sym[0], sym[1], sym[2], sym[3], sym[4], sym[5], sym[6], 0 };
+  if(sym[5] != NULL && (lib->flags & BACKEND_SIZED_FREE_FLAGS)){
+    backend_sized_free_flags = (void (*)(void*, size_t, int))sym[5];
+    be.sized_free = sized_free_no_flags;
+  }
+  if(sym[6] != NULL && (lib->flags & BACKEND_GOOD_SIZE_FLAGS)){
+    backend_good_size_flags = (size_t (*)(size_t, int))sym[6];
+    be.good_size = good_size_no_flags;
+  }
+  backend = be;
+  return 1;
+}
+
+static void backend_init(const char *name)
+{
+  int loaded = strcmp(name, "glibc") == 0;
+  for(size_t i = 0; i < sizeof(backend_libs)/sizeof(backend_libs[0]) && !loaded; i++){
+    if(strcmp(name, backend_libs[i].name) == 0) loaded = backend_load(&backend_libs[i]);
+  }
+
+  const char *err = dlerror();
+  if(!loaded){
+    fprintf(stderr, "[FLOATZONE] cannot load backend '%s' (%s), using glibc\n",
+            name, err != NULL ? err : "unknown backend");
+  }
+  // the message is freed by the next dlerror(): do it before free() only
+  // expects chunks of ours
+  if(err != NULL) dlerror();
+}
+
+// give a chunk of `usable` bytes back to the backend
+static inline void backend_free(void* ptr, size_t usable)
+{
+  if(backend.sized_free != NULL) backend.sized_free(ptr, usable);
+  else backend.free(ptr);
+}
+
+
+// Sampling (FLOATZONE_OPTIONS sample_*), in the style of GWP-ASan
+// Only the sampled allocations get redzones and the quarantine, the others
+// go to the backend behind a bare header:
+//   [Header (flags CHUNK_PLAIN)][payload]
+// Where a plain chunk has the flags and magic of its header, a sampled one
+// has the end of its underflow redzone (0x8b), so free() and realloc() tell
+// them apart from the pointer alone. Allocations are sampled:
+//  - by size, between sample_min_bytes and sample_max_bytes, then
+//  - 1 in sample_rate, either at random intervals per thread or, with
+//    sample_sites=1, for 1 in sample_rate call sites (all of their calls)
+static int sampling = 0; // any sample_* option given
+static uint64_t sample_rate = 1;
+static size_t sample_min_bytes = 0;
+static size_t sample_max_bytes = SIZE_MAX;
+static int sample_sites = 0;
+static uint64_t sample_seed;
+
+static __thread uint64_t sample_countdown __attribute__((tls_model("initial-exec")));
+static __thread uint64_t sample_rng __attribute__((tls_model("initial-exec")));
+
+static inline uint64_t sample_mix(uint64_t x)
+{
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  return x;
+}
+
+static inline int sample(size_t size, void* site)
+{
+  if(size < sample_min_bytes || size > sample_max_bytes) return 0;
+  if(sample_rate <= 1) return 1;
+  if(sample_sites) return sample_mix((uintptr_t)site ^ sample_seed) % sample_rate == 0;
+
+  if(sample_countdown > 1){
+    sample_countdown--;
+    return 0;
+  }
+  // next one in [1, 2*sample_rate - 1] allocations, sample_rate on average
+  if(sample_rng == 0) sample_rng = sample_seed ^ (uintptr_t)&sample_rng;
+  sample_rng ^= sample_rng << 13;
+  sample_rng ^= sample_rng >> 7;
+  sample_rng ^= sample_rng << 17;
+  sample_countdown = 1 + sample_rng % (2*sample_rate - 1);
+  return 1;
+}
+
+static inline int chunk_plain(void* ptr)
+{
+  Header* h = (Header*)ptr - 1;
+  return h->magic == CHUNK_MAGIC && (h->flags & CHUNK_PLAIN) != 0;
+}
+
+static inline void* plain_malloc(size_t size)
+{
+  if(size > SIZE_MAX - sizeof(Header)) return NULL;
+  Header* h = backend.malloc(sizeof(Header) + size);
+  if(h == NULL) return NULL;
+  *h = (Header){ size, 0, CHUNK_PLAIN, CHUNK_MAGIC };
+  return h + 1;
+}
+
+static inline void* plain_calloc(size_t size)
+{
+  if(size > SIZE_MAX - sizeof(Header)) return NULL;
+  Header* h = backend.calloc(1, sizeof(Header) + size);
+  if(h == NULL) return NULL;
+  *h = (Header){ size, 0, CHUNK_PLAIN, CHUNK_MAGIC };
+  return h + 1;
+}
 
+static inline void* plain_realloc(void* ptr, size_t size)
+{
+  if(size > SIZE_MAX - sizeof(Header)) return NULL;
+  Header* h = backend.realloc((Header*)ptr - 1, sizeof(Header) + size);
+  if(h == NULL) return NULL;
+  h->size = size;
+  return h + 1;
+}
+
+static inline void plain_free(void* ptr)
+{
+  Header* h = (Header*)ptr - 1;
+  backend_free(h, sizeof(Header) + h->size);
+}
+
+// Slab allocator (FLOATZONE_OPTIONS slab=1)
+// Requests up to SLAB_MAX_SIZE are served from size classes 16 bytes apart,
+// out of spans bump-allocated in one reserved region. Slots are laid out
+// like glibc chunks, without glibc's own header or rounding:
+//   [Header][underflow redzone][payload: class size][tail: REDZONE_SIZE]
+// A span gets the redzone pattern once, when it is carved, and free slots
+// stay poisoned: an allocation only clears its payload and writes its
+// overflow redzone. Each thread caches free slots per class, and moves them
+// from/to the class lists SLAB_BATCH at a time.
+#define SLAB_REGION_BYTES (64ULL << 30) // 64 GB, reserved up front
+#define SLAB_SPAN_BYTES 65536
+#define SLAB_MAX_SIZE 1024
+#define SLAB_CLASSES (SLAB_MAX_SIZE/16)
+#define SLAB_BATCH 32
+
+typedef struct SlabClass SlabClass;
+struct SlabClass {
+  pthread_mutex_t lock;
+  uint8_t *free; // linked through the header, see slot_next()
+};
+
+typedef struct SlabCache SlabCache;
+struct SlabCache {
+  uint8_t *free[SLAB_CLASSES];
+  uint32_t len[SLAB_CLASSES];
+  int init;
+};
+
+static int slab_enabled = 0;
+static uint8_t *slab_base = NULL;
+static uint8_t *slab_end = NULL;
+static uintptr_t slab_next = 0; // next span to carve
+static SlabClass slab_class[SLAB_CLASSES];
+static __thread SlabCache slab_cache __attribute__((tls_model("initial-exec")));
+static pthread_key_t slab_key;
+
+static inline int in_slab(void *ptr)
+{
+  return (uint8_t*)ptr >= slab_base && (uint8_t*)ptr < slab_end;
+}
+
+// A free slot keeps the link to the next one in its header's size field:
+// the payload stays poisoned, so a double free of it is still caught.
+static inline uint8_t *slot_next(uint8_t *chunk)
+{
+  return (uint8_t*)(uintptr_t)((Header*)chunk)->size;
+}
+
+static inline void slot_set_next(uint8_t *chunk, uint8_t *next)
+{
+  ((Header*)chunk)->size = (uintptr_t)next;
+}
+
+// class of a slot, from its header
+static inline size_t slab_class_of(uint8_t *chunk)
+{
+  return (chunk_usable((Header*)chunk) - CHUNK_PADDING - 1) >> 4;
+}
+
+// carve a new span into the list of class `c`, with its lock held
+static int slab_carve(size_t c)
+{
+  uint8_t *span = (uint8_t*)__atomic_fetch_add(&slab_next, SLAB_SPAN_BYTES, __ATOMIC_RELAXED);
+  if(span + SLAB_SPAN_BYTES > slab_end) return 0;
+
+  size_t stride = CHUNK_PADDING + (c + 1)*16;
+  memset(span, FLOAT_MAGIC_POISON_BYTE, SLAB_SPAN_BYTES);
+  for(uint8_t *chunk = span; chunk + stride <= span + SLAB_SPAN_BYTES; chunk += stride){
+    *((Header*)chunk) = (Header){ 0, 0, CHUNK_SLAB, CHUNK_MAGIC };
+    chunk[sizeof(Header)] = FLOAT_MAGIC_POISON_PRE_BYTE;
+    slot_set_next(chunk, slab_class[c].free);
+    slab_class[c].free = chunk;
+  }
+  return 1;
+}
+
+// move all but `keep` cached slots of class `c` back to the class list
+static void slab_flush(SlabCache *tc, size_t c, uint32_t keep)
+{
+  if(tc->len[c] <= keep) return;
+  pthread_mutex_lock(&slab_class[c].lock);
+  while(tc->len[c] > keep){
+    uint8_t *chunk = tc->free[c];
+    tc->free[c] = slot_next(chunk);
+    tc->len[c]--;
+    slot_set_next(chunk, slab_class[c].free);
+    slab_class[c].free = chunk;
+  }
+  pthread_mutex_unlock(&slab_class[c].lock);
+}
+
+static void slab_refill(SlabCache *tc, size_t c)
+{
+  pthread_mutex_lock(&slab_class[c].lock);
+  if(slab_class[c].free != NULL || slab_carve(c)){
+    while(tc->len[c] < SLAB_BATCH && slab_class[c].free != NULL){
+      uint8_t *chunk = slab_class[c].free;
+      slab_class[c].free = slot_next(chunk);
+      slot_set_next(chunk, tc->free[c]);
+      tc->free[c] = chunk;
+      tc->len[c]++;
+    }
+  }
+  pthread_mutex_unlock(&slab_class[c].lock);
+}
+
+// pthread_key destructor: give the cached slots of an exiting thread back
+static void slab_retire(void *arg)
+{
+  SlabCache *tc = (SlabCache*)arg;
+  for(size_t c = 0; c < SLAB_CLASSES; c++) slab_flush(tc, c, 0);
+  tc->init = 0;
+}
+
+static inline SlabCache *slab_thread_cache()
+{
+  SlabCache *tc = &slab_cache;
+  if(!tc->init){
+    // first, pthread_setspecific() may allocate
+    tc->init = 1;
+    pthread_setspecific(slab_key, tc);
+  }
+  return tc;
+}
+
+// payload of `size` (1..SLAB_MAX_SIZE) bytes, NULL once the region is full
+static void *slab_alloc(size_t size)
+{
+  SlabCache *tc = slab_thread_cache();
+  size_t c = (size - 1) >> 4;
+
+  uint8_t *chunk = tc->free[c];
+  if(chunk == NULL){
+    slab_refill(tc, c);
+    chunk = tc->free[c];
+    if(chunk == NULL) return NULL;
+  }
+  tc->free[c] = slot_next(chunk);
+  tc->len[c]--;
+
+  Header *h = (Header*)chunk;
+  h->size = size;
+  h->slack = (c + 1)*16 - size;
+
+  uint8_t *ptr = chunk + CHUNK_PAYLOAD;
+  memset(ptr, 0, size);
+  *((struct redzone*)(ptr + size)) = redzone_s;
+  return ptr;
+}
+
+// take back a slot whose payload is poisoned again
+static void slab_release(uint8_t *chunk)
+{
+  SlabCache *tc = slab_thread_cache();
+  size_t c = slab_class_of(chunk);
+
+  slot_set_next(chunk, tc->free[c]);
+  tc->free[c] = chunk;
+  if(++tc->len[c] >= 2*SLAB_BATCH) slab_flush(tc, c, SLAB_BATCH);
+}
+
+static void slab_atfork_child()
+{
+  for(size_t c = 0; c < SLAB_CLASSES; c++) pthread_mutex_init(&slab_class[c].lock, NULL);
+}
+
+static void slab_init()
+{
+  void *mem = mmap(NULL, SLAB_REGION_BYTES, PROT_READ|PROT_WRITE,
+                   MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+  if(mem == MAP_FAILED){
+    slab_enabled = 0;
+    return;
+  }
+  slab_base = (uint8_t*)mem;
+  slab_end = slab_base + SLAB_REGION_BYTES;
+  slab_next = (uintptr_t)mem;
+  for(size_t c = 0; c < SLAB_CLASSES; c++) pthread_mutex_init(&slab_class[c].lock, NULL);
+  pthread_key_create(&slab_key, slab_retire);
+  pthread_atfork(NULL, NULL, slab_atfork_child);
+}
 
 // quarantine
 #if ENABLE_QUARANTINE == 1
@@ -109,68 +684,804 @@ typedef struct Ring Ring;
 struct Ring {
   void* ptr;
   size_t size;
+  int paged; // interior pages are PROT_NONE, see poison_chunk()
+};
+
+// Every thread owns a shard of the quarantine (its own FIFO rings and byte
+// counts), so free() never takes a global lock. The owner is the only
+// producer of its rings; evictions (by the owner or the drainer thread)
+// dequeue in batches under the shard lock and zero/release the batch after
+// dropping it. The global byte counts are updated every QUARANTINE_FLUSH_BYTES
+// per shard, with a relaxed atomic.
+//
+// Chunks are quarantined by size tier, each tier with its own FIFO and its
+// own part of the budget (tier_percent), so a single big free() cannot
+// flush the small chunks out: those get the largest share per byte and stay
+// quarantined the longest. A chunk larger than the whole budget of its tier
+// is released right away.
+// A shard evicts the oldest entries of a tier when the process is over the
+// budget of that tier and the shard holds more than its fair share of it.
+//
+// The rings only reserve address space for tier_entries up front; they start
+// at QUARANTINE_RING_MIN_ELEMS and double whenever they fill up.
+#define QUARANTINE_RING_MIN_ELEMS 1024
+#define QUARANTINE_FLUSH_BYTES 262144 // 256 KB
+#define QUARANTINE_MIN_SHARD_BYTES 4194304 // 4 MB
+#define QUARANTINE_EVICT_BATCH 64
+// upper chunk size (redzones included) of the small and medium tiers
+#define QUARANTINE_SMALL_BYTES 1024
+#define QUARANTINE_MEDIUM_BYTES 131072 // 128 KB
+// chunks from this size on are quarantined at page granularity
+#define QUARANTINE_PAGED_BYTES 262144 // 256 KB
+// poison/zero with non-temporal stores from this length on
+#define QUARANTINE_NT_BYTES 65536 // 64 KB
+// recycle bins: one per usable size up to RECYCLE_MAX_BYTES
+#define RECYCLE_MAX_BYTES 2048
+#define RECYCLE_CLASSES (RECYCLE_MAX_BYTES/16 + 1)
+#define RECYCLE_BIN_MAX 32
+
+enum { TIER_SMALL, TIER_MEDIUM, TIER_LARGE, QUARANTINE_TIERS };
+static const int64_t tier_percent[QUARANTINE_TIERS] = { 40, 40, 20 };
+static const size_t tier_min_chunk[QUARANTINE_TIERS] = {
+  MIN_ALLOC_SIZE, QUARANTINE_SMALL_BYTES + 1, QUARANTINE_MEDIUM_BYTES + 1
 };
 
-#define MAX_RING_ELEMS (QUARANTINE_SIZE_BYTES/MIN_ALLOC_SIZE)
-Ring ring[MAX_RING_ELEMS];
-// 5000 elements -> 256 MB allocated memory -> start clearing
-size_t front = 0;
-size_t rear = 0;
-uint64_t quarantine_size = 0; // in bytes
-pthread_mutex_t ring_lock;
+typedef struct Tier Tier;
+struct Tier {
+  Ring *ring;           // `cap` entries committed, tier_entries reserved
+  size_t cap;           // written by the owner under the lock
+  size_t front;         // written by consumers
+  size_t rear;          // written by the owner
+  int64_t size;         // in bytes
+  int64_t unflushed;    // owner's bytes not yet added to quarantine_size
+};
+
+typedef struct Shard Shard;
+struct Shard {
+  pthread_mutex_t lock; // taken by consumers only
+  Tier tier[QUARANTINE_TIERS];
+  uint32_t ticks;       // enqueues since the last quarantine_adapt() check
+  int orphan;
+  Shard *next;          // orphan list
+  Shard *all_next;      // registry of all shards
+#if ENABLE_RECYCLE == 1
+  // evicted chunks, still poisoned, linked through their header (see
+  // recycle_push()) and indexed by usable size / 16. Owner only.
+  uint8_t *bin[RECYCLE_CLASSES];
+  uint8_t bin_len[RECYCLE_CLASSES];
+#endif
+};
 
-void append_to_list(void *ptr, size_t size)
+static int64_t quarantine_budget = QUARANTINE_SIZE_BYTES; // see quarantine_adapt()
+static size_t quarantine_max_entries = 0; // 0: derived from the budget
+static size_t tier_entries[QUARANTINE_TIERS]; // ring sizes, see parse_options()
+static int quarantine_hugepages = 0;
+static int quarantine_adaptive = 0;
+static int64_t quarantine_min_bytes = QUARANTINE_ADAPT_MIN_BYTES;
+static int64_t quarantine_max_bytes = 0;
+static uint64_t quarantine_adapt_ms = 1000;
+
+static __thread Shard *my_shard __attribute__((tls_model("initial-exec")));
+int64_t quarantine_size[QUARANTINE_TIERS]; // in bytes, approximate
+static uint32_t nr_shards = 0; // shards owned by a live thread
+// shards of exited threads, adopted by the next new thread
+static Shard *orphans = NULL;
+static Shard *all_shards = NULL;
+static pthread_mutex_t orphan_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t shard_key;
+
+#if ENABLE_DRAINER == 1
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t drain_cond = PTHREAD_COND_INITIALIZER;
+static int drain_requested = 0;
+#endif
+
+// memset() bypassing the cache: a quarantined chunk is not read again for
+// a long time, it should not evict the application's working set
+static void stream_fill_sse2(uint8_t *p, int c, size_t len)
 {
-  // enqueue
-  pthread_mutex_lock(&ring_lock);
-  ring[rear].ptr = ptr;
-  ring[rear].size = size;
-  rear = rear + 1;
-  if(rear == MAX_RING_ELEMS) rear = 0;
-  // apply the poison (the first REDZONE_SIZE bytes (underflow) can be skipped)
+  size_t head = (-(uintptr_t)p) & 15;
+  memset(p, c, head);
+  p += head;
+  len -= head;
+  __m128i v = _mm_set1_epi8((char)c);
+  for(; len >= 64; p += 64, len -= 64){
+    _mm_stream_si128((__m128i*)p, v);
+    _mm_stream_si128((__m128i*)(p + 16), v);
+    _mm_stream_si128((__m128i*)(p + 32), v);
+    _mm_stream_si128((__m128i*)(p + 48), v);
+  }
+  for(; len >= 16; p += 16, len -= 16) _mm_stream_si128((__m128i*)p, v);
+  _mm_sfence();
+  memset(p, c, len);
+}
+
+static __attribute__((target("avx2"))) void stream_fill_avx2(uint8_t *p, int c, size_t len)
+{
+  size_t head = (-(uintptr_t)p) & 31;
+  memset(p, c, head);
+  p += head;
+  len -= head;
+  __m256i v = _mm256_set1_epi8((char)c);
+  for(; len >= 64; p += 64, len -= 64){
+    _mm256_stream_si256((__m256i*)p, v);
+    _mm256_stream_si256((__m256i*)(p + 32), v);
+  }
+  _mm_sfence();
+  memset(p, c, len);
+}
+
+// whole cache lines, one store each
+static __attribute__((target("avx512f"))) void stream_fill_avx512(uint8_t *p, int c, size_t len)
+{
+  size_t head = (-(uintptr_t)p) & 63;
+  memset(p, c, head);
+  p += head;
+  len -= head;
+  __m512i v = _mm512_set1_epi8((char)c);
+  for(; len >= 64; p += 64, len -= 64) _mm512_stream_si512((void*)p, v);
+  _mm_sfence();
+  memset(p, c, len);
+}
+
+// picked at startup, see pick_kernels()
+static void (*stream_fill)(uint8_t *p, int c, size_t len) = stream_fill_sse2;
+
+static void memset_nt(void *dst, int c, size_t len)
+{
+  if(len < QUARANTINE_NT_BYTES){
+    memset(dst, c, len);
+    return;
+  }
+  stream_fill((uint8_t*)dst, c, len);
+}
+
+// glibc serves big requests with a private mmap, unmapped again by free()
+static inline int chunk_is_mmapped(void *ptr)
+{
+  return backend.glibc && (((size_t*)ptr)[-1] & 2) != 0; // IS_MMAPPED
+}
+
+// interior pages [*lo, *hi) of a chunk, keeping at least a redzone of
+// poison on both sides of them
+static inline int paged_range(void *ptr, size_t size, uint8_t **lo, uint8_t **hi)
+{
+  if(size < QUARANTINE_PAGED_BYTES) return 0;
+  uintptr_t begin = (uintptr_t)ptr + CHUNK_PADDING;
+  uintptr_t end = (uintptr_t)ptr + size - 2*REDZONE_SIZE;
+  *lo = (uint8_t*)((begin + 4095) & ~(uintptr_t)4095);
+  *hi = (uint8_t*)(end & ~(uintptr_t)4095);
+  return *lo < *hi;
+}
+
+// Fill a freed chunk with the redzone pattern (the header is kept, and the
+// underflow redzone already is one). Big chunks only get their edges
+// poisoned: their interior pages are dropped and made inaccessible, so a
+// use-after-free there faults with SIGSEGV instead (see segfault_handler()).
+// Returns 1 in that case.
+static int poison_chunk(void *ptr, size_t size)
+{
+  uint8_t *p = (uint8_t*)ptr;
+  uint8_t *lo, *hi;
+
+  if(paged_range(ptr, size, &lo, &hi) && mprotect(lo, hi - lo, PROT_NONE) == 0){
+    madvise(lo, hi - lo, MADV_DONTNEED);
+    index_set(lo, hi - lo, (Header*)((uintptr_t)ptr | INDEX_FREED));
+    memset_nt(p + CHUNK_PAYLOAD, FLOAT_MAGIC_POISON_BYTE, lo - (p + CHUNK_PAYLOAD));
+    // the 0x89 stops the handler's scan for the redzone start before it
+    // walks into the inaccessible pages
+    *((struct redzone*)hi) = redzone_s;
+    memset(hi + REDZONE_SIZE, FLOAT_MAGIC_POISON_BYTE, p + size - (REDZONE_SIZE-1) - (hi + REDZONE_SIZE));
+    return 1;
+  }
   // the last 15 bytes are also guaranteed to be 0x8b
-  // update quarantine size
-  quarantine_size += size;
-  pthread_mutex_unlock(&ring_lock);
+  memset_nt(p + CHUNK_PAYLOAD, FLOAT_MAGIC_POISON_BYTE, size-CHUNK_PAYLOAD-(REDZONE_SIZE-1));
+  return 0;
+}
+
+// zero a chunk leaving the quarantine and give it back to glibc
+static void release_chunk(void *ptr, size_t size, int paged)
+{
+  uint8_t *p = (uint8_t*)ptr;
+  uint8_t *lo, *hi;
 
-  memset(((uint8_t*)ptr)+REDZONE_SIZE, FLOAT_MAGIC_POISON_BYTE, size-REDZONE_SIZE-(REDZONE_SIZE-1));
+  // slots stay poisoned while free
+  if(in_slab(ptr)){
+    slab_release(p);
+    return;
+  }
+  paged = paged && paged_range(ptr, size, &lo, &hi);
+  // unmapped as a whole, no matter what it contains; the addresses will
+  // be reused, so they leave the index first
+  if(((Header*)ptr)->flags & CHUNK_MMAP){
+    if(paged) index_set(lo, hi - lo, NULL);
+    munmap(ptr, size);
+    return;
+  }
+  if(chunk_is_mmapped(ptr)){
+    if(paged) index_set(lo, hi - lo, NULL);
+    backend_free(ptr, size);
+    return;
+  }
+  if(paged){
+    // cannot hand inaccessible pages back to glibc: leak the chunk instead
+    if(mprotect(lo, hi - lo, PROT_READ|PROT_WRITE) != 0) return;
+    index_set(lo, hi - lo, NULL);
+    // the interior reads back as zero since MADV_DONTNEED
+    memset(p, 0, lo - p);
+    memset(hi, 0, p + size - hi);
+  }
+  else {
+    memset_nt(p, 0, size);
+  }
+  backend_free(ptr, size);
 }
 
-void pop_last_from_list()
+#if ENABLE_RECYCLE == 1
+// Chunks evicted by their owner thread skip the round trip through glibc:
+// they keep their poison in a per-size bin, and the next allocation of that
+// size only clears the payload and writes the overflow redzone.
+// A binned chunk keeps the link to the next one in its header's size field
+// and its usable size in the slack field: the payload stays poisoned, so
+// a double free of it is still caught.
+static inline uint8_t *bin_next(uint8_t *chunk)
 {
-  void *ptr_to_clean;
-  size_t size_to_clean;
+  return (uint8_t*)(uintptr_t)((Header*)chunk)->size;
+}
 
-  pthread_mutex_lock(&ring_lock);
-  // dequeue
-  if(front != rear){
-    ptr_to_clean = ring[front].ptr;
-    size_to_clean = ring[front].size;
-    quarantine_size -= ring[front].size;
+static inline size_t bin_usable(uint8_t *chunk)
+{
+  return CHUNK_PADDING + ((Header*)chunk)->slack;
+}
 
-    front = (front + 1);
-    if(front == MAX_RING_ELEMS) front = 0;
+static int recycle_push(Shard *s, uint8_t *chunk, size_t size, int paged)
+{
+  if(paged || size > RECYCLE_MAX_BYTES || in_slab(chunk)) return 0;
+  size_t c = size >> 4;
+  if(s->bin_len[c] >= RECYCLE_BIN_MAX) return 0;
+  ((Header*)chunk)->size = (uintptr_t)s->bin[c];
+  ((Header*)chunk)->slack = size - CHUNK_PADDING;
+  s->bin[c] = chunk;
+  s->bin_len[c]++;
+  return 1;
+}
 
-    pthread_mutex_unlock(&ring_lock);
+// payload of `size` bytes from the bin the backend would have picked for it
+static inline void *recycle_pop(size_t size)
+{
+  Shard *s = my_shard;
+  if(s == NULL || size > RECYCLE_MAX_BYTES || backend.good_size == NULL) return NULL;
+
+  size_t usable = backend.good_size(CHUNK_PADDING + size);
+  if(usable > RECYCLE_MAX_BYTES) return NULL;
+  size_t c = usable >> 4;
+  uint8_t *chunk = s->bin[c];
+  if(chunk == NULL) return NULL;
+  // bins are 16 bytes wide, backend size classes may be narrower
+  usable = bin_usable(chunk);
+  if(usable < CHUNK_PADDING + size) return NULL;
+  s->bin[c] = bin_next(chunk);
+  s->bin_len[c]--;
+
+  // the underflow redzone and the tail are still in place
+  uint8_t *ptr = chunk + CHUNK_PAYLOAD;
+  set_header(ptr, size, usable - CHUNK_PADDING - size);
+  memset(ptr, 0, size);
+  *((struct redzone*)(ptr + size)) = redzone_s;
+  return ptr;
+}
 
-    memset(ptr_to_clean, 0, size_to_clean);
-    __libc_free(ptr_to_clean);
+static void recycle_flush(Shard *s)
+{
+  for(size_t c = 0; c < RECYCLE_CLASSES; c++){
+    while(s->bin[c] != NULL){
+      uint8_t *chunk = s->bin[c];
+      s->bin[c] = bin_next(chunk);
+      release_chunk(chunk, bin_usable(chunk), 0);
+    }
+    s->bin_len[c] = 0;
   }
-  else{
-    // empty: set to zero
-    quarantine_size = 0;
-    pthread_mutex_unlock(&ring_lock);
+}
+#endif
+
+static inline int tier_of(size_t size)
+{
+  if(size <= QUARANTINE_SMALL_BYTES) return TIER_SMALL;
+  if(size <= QUARANTINE_MEDIUM_BYTES) return TIER_MEDIUM;
+  return TIER_LARGE;
+}
+
+static inline int64_t tier_load(int t)
+{
+  return __atomic_load_n(&quarantine_size[t], __ATOMIC_RELAXED);
+}
+
+static inline int64_t quarantine_load()
+{
+  int64_t total = 0;
+  for(int t = 0; t < QUARANTINE_TIERS; t++) total += tier_load(t);
+  return total;
+}
+
+static inline int64_t quarantine_limit()
+{
+  return __atomic_load_n(&quarantine_budget, __ATOMIC_RELAXED);
+}
+
+static inline int64_t tier_limit(int t)
+{
+  return quarantine_limit() * tier_percent[t] / 100;
+}
+
+#if ENABLE_DRAINER == 1
+// some tier is over its budget
+static int quarantine_over()
+{
+  for(int t = 0; t < QUARANTINE_TIERS; t++){
+    if(tier_load(t) > tier_limit(t)) return 1;
+  }
+  return 0;
+}
+#endif
+
+static uint64_t quarantine_share(int t)
+{
+  uint32_t n = __atomic_load_n(&nr_shards, __ATOMIC_RELAXED);
+  uint64_t share = tier_limit(t) / (n ? n : 1);
+  uint64_t min = QUARANTINE_MIN_SHARD_BYTES * tier_percent[t] / 100;
+  if(share < min) share = min;
+  return share;
+}
+
+static inline size_t ring_bytes(int t)
+{
+  return (tier_entries[t]*sizeof(Ring) + 4095) & ~(size_t)4095;
+}
+
+static Shard *new_shard()
+{
+  Shard *s;
+
+  pthread_mutex_lock(&orphan_lock);
+  s = orphans;
+  if(s != NULL) orphans = s->next;
+  pthread_mutex_unlock(&orphan_lock);
+
+  if(s == NULL){
+    // reserve the largest rings, but only commit their first entries
+    size_t head = 4096;
+    size_t len = head;
+    for(int t = 0; t < QUARANTINE_TIERS; t++) len += ring_bytes(t);
+    void *mem = mmap(NULL, len, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if(mem == MAP_FAILED) return NULL;
+    if(quarantine_hugepages) madvise(mem, len, MADV_HUGEPAGE);
+    if(mprotect(mem, head, PROT_READ|PROT_WRITE) != 0){
+      munmap(mem, len);
+      return NULL;
+    }
+    s = (Shard*)mem;
+    uint8_t *ring = (uint8_t*)mem + head;
+    for(int t = 0; t < QUARANTINE_TIERS; t++){
+      size_t init = QUARANTINE_RING_MIN_ELEMS;
+      if(init > tier_entries[t]) init = tier_entries[t];
+      if(mprotect(ring, init*sizeof(Ring), PROT_READ|PROT_WRITE) != 0){
+        munmap(mem, len);
+        return NULL;
+      }
+      s->tier[t].ring = (Ring*)ring;
+      s->tier[t].cap = init;
+      ring += ring_bytes(t);
+    }
+    pthread_mutex_init(&s->lock, NULL);
+
+    pthread_mutex_lock(&orphan_lock);
+    s->all_next = all_shards;
+    __atomic_store_n(&all_shards, s, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&orphan_lock);
+  }
+  s->next = NULL;
+  s->orphan = 0;
+
+  __atomic_add_fetch(&nr_shards, 1, __ATOMIC_RELAXED);
+  pthread_setspecific(shard_key, s);
+  return s;
+}
+
+// pthread_key destructor: hand the quarantined chunks of an exiting
+// thread over to the orphan list instead of releasing them early
+static void retire_shard(void *arg)
+{
+  Shard *s = (Shard*)arg;
+
+  for(int t = 0; t < QUARANTINE_TIERS; t++){
+    __atomic_add_fetch(&quarantine_size[t], s->tier[t].unflushed, __ATOMIC_RELAXED);
+    s->tier[t].unflushed = 0;
+  }
+  __atomic_sub_fetch(&nr_shards, 1, __ATOMIC_RELAXED);
+  my_shard = NULL;
+#if ENABLE_RECYCLE == 1
+  recycle_flush(s);
+#endif
+
+  pthread_mutex_lock(&orphan_lock);
+  s->orphan = 1;
+  s->next = orphans;
+  orphans = s;
+  pthread_mutex_unlock(&orphan_lock);
+}
+
+// dequeue up to QUARANTINE_EVICT_BATCH entries of tier `t` (at least one,
+// stopping once `want` bytes are collected) under a single lock acquisition,
+// then zero and release them outside the lock. Returns the bytes evicted.
+static int64_t evict_batch(Shard *s, int t, int64_t want)
+{
+  Tier *q = &s->tier[t];
+  Ring batch[QUARANTINE_EVICT_BATCH];
+  int n = 0;
+  int64_t bytes = 0;
+
+  pthread_mutex_lock(&s->lock);
+  size_t front = q->front;
+  size_t rear = __atomic_load_n(&q->rear, __ATOMIC_ACQUIRE);
+  while(front != rear && n < QUARANTINE_EVICT_BATCH && bytes < want){
+    batch[n] = q->ring[front];
+    bytes += batch[n].size;
+    n++;
+    front = front + 1;
+    if(front == q->cap) front = 0;
+  }
+  __atomic_store_n(&q->front, front, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&s->lock);
+
+  if(n == 0) return 0;
+  __atomic_sub_fetch(&q->size, bytes, __ATOMIC_RELAXED);
+  __atomic_sub_fetch(&quarantine_size[t], bytes, __ATOMIC_RELAXED);
+
+  for(int i = 0; i < n; i++){
+#if ENABLE_RECYCLE == 1
+    if(s == my_shard && recycle_push(s, batch[i].ptr, batch[i].size, batch[i].paged)) continue;
+#endif
+    release_chunk(batch[i].ptr, batch[i].size, batch[i].paged);
+  }
+  return bytes;
+}
+
+// evict from tier `t` of `s` until it holds at most `keep` bytes and the
+// process at most `limit` bytes in that tier
+static void evict_shard(Shard *s, int t, int64_t keep, int64_t limit)
+{
+  for(;;){
+    int64_t over_shard = __atomic_load_n(&s->tier[t].size, __ATOMIC_RELAXED) - keep;
+    int64_t over_total = tier_load(t) - limit;
+    if(over_shard <= 0 || over_total <= 0) return;
+    if(evict_batch(s, t, over_shard < over_total ? over_shard : over_total) == 0) return;
+  }
+}
+
+// over the global budget but not over our share: release orphaned chunks
+static void drain_orphans()
+{
+  if(pthread_mutex_trylock(&orphan_lock) != 0) return;
+  for(Shard *o = orphans; o != NULL; o = o->next){
+    for(int t = 0; t < QUARANTINE_TIERS; t++) evict_shard(o, t, 0, tier_limit(t));
+  }
+  pthread_mutex_unlock(&orphan_lock);
+}
+
+// Adaptive budget: every quarantine_adapt_ms, move the budget between
+// quarantine_min_bytes and quarantine_max_bytes based on what the process
+// can afford. Under a cgroup v2 memory.high/memory.max limit, the quarantine
+// may take half of the remaining headroom (memory.current, or our RSS when
+// it cannot be read). PSI memory stalls halve it (some avg10 above
+// QUARANTINE_PSI_SHRINK) or freeze its growth (above QUARANTINE_PSI_HOLD).
+// It shrinks at once, but grows by at most 1/8 of the maximum per step.
+static char cgroup_dir[256];
+static uint64_t next_adapt_ns = 0;
+
+static ssize_t read_file(const char *path, char *buf, size_t len)
+{
+  // no stdio: this runs inside free()
+  int fd = open(path, O_RDONLY|O_CLOEXEC);
+  if(fd < 0) return -1;
+  ssize_t n = read(fd, buf, len - 1);
+  close(fd);
+  if(n < 0) return -1;
+  buf[n] = '\0';
+  return n;
+}
+
+// value of a cgroup memory file, or -1 if unlimited/unavailable
+static int64_t read_cgroup_value(const char *name)
+{
+  char path[sizeof(cgroup_dir) + 32];
+  char buf[64];
+
+  if(cgroup_dir[0] == '\0') return -1;
+  snprintf(path, sizeof(path), "%s/%s", cgroup_dir, name);
+  if(read_file(path, buf, sizeof(buf)) <= 0 || buf[0] < '0' || buf[0] > '9') return -1;
+  return strtoll(buf, NULL, 10);
+}
+
+static void find_cgroup_dir()
+{
+  char buf[512];
+
+  // cgroup v2: a single "0::/path" line
+  if(read_file("/proc/self/cgroup", buf, sizeof(buf)) <= 0) return;
+  char *line = strstr(buf, "0::");
+  if(line == NULL || (line != buf && line[-1] != '\n')) return;
+  line += 3;
+  line[strcspn(line, "\n")] = '\0';
+  snprintf(cgroup_dir, sizeof(cgroup_dir), "/sys/fs/cgroup%s", strcmp(line, "/") ? line : "");
+  if(read_cgroup_value("memory.max") < 0 && read_cgroup_value("memory.high") < 0 &&
+     read_cgroup_value("memory.current") < 0){
+    cgroup_dir[0] = '\0';
+  }
+}
+
+// "some avg10=12.34 ..." -> 1234, -1 if unavailable
+static int64_t read_psi_some_avg10()
+{
+  char path[sizeof(cgroup_dir) + 32];
+  char buf[256];
+
+  snprintf(path, sizeof(path), "%s/memory.pressure", cgroup_dir);
+  if(cgroup_dir[0] == '\0' || read_file(path, buf, sizeof(buf)) <= 0){
+    if(read_file("/proc/pressure/memory", buf, sizeof(buf)) <= 0) return -1;
+  }
+  char *avg = strstr(buf, "some avg10=");
+  if(avg == NULL) return -1;
+  char *end;
+  int64_t stall = strtoll(avg + 11, &end, 10) * 100;
+  if(*end == '.') stall += strtoll(end + 1, NULL, 10) % 100;
+  return stall;
+}
+
+static int64_t read_rss()
+{
+  char buf[128];
+  if(read_file("/proc/self/statm", buf, sizeof(buf)) <= 0) return -1;
+  char *resident = strchr(buf, ' ');
+  if(resident == NULL) return -1;
+  return strtoll(resident + 1, NULL, 10) * sysconf(_SC_PAGESIZE);
+}
+
+static void quarantine_adapt()
+{
+  int64_t budget = quarantine_limit();
+  int64_t target = quarantine_max_bytes;
+
+  int64_t limit = read_cgroup_value("memory.max");
+  int64_t high = read_cgroup_value("memory.high");
+  if(high >= 0 && (limit < 0 || high < limit)) limit = high;
+  if(limit >= 0){
+    int64_t usage = read_cgroup_value("memory.current");
+    if(usage < 0) usage = read_rss();
+    if(usage >= 0){
+      int64_t fit = quarantine_load() + (limit - usage)/2;
+      if(fit < target) target = fit;
+    }
+  }
+
+  int64_t stall = read_psi_some_avg10();
+  if(stall >= QUARANTINE_PSI_SHRINK){
+    if(budget/2 < target) target = budget/2;
+  }
+  else if(stall >= QUARANTINE_PSI_HOLD){
+    if(budget < target) target = budget;
+  }
+
+  int64_t step = quarantine_max_bytes/8;
+  if(target > budget + step) target = budget + step;
+  if(target < quarantine_min_bytes) target = quarantine_min_bytes;
+  if(target > quarantine_max_bytes) target = quarantine_max_bytes;
+  __atomic_store_n(&quarantine_budget, target, __ATOMIC_RELAXED);
+}
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+// run quarantine_adapt() if its period elapsed and no other thread took it
+static int quarantine_adapt_due()
+{
+  uint64_t now = now_ns();
+  uint64_t next = __atomic_load_n(&next_adapt_ns, __ATOMIC_RELAXED);
+  if(now < next) return 0;
+  if(!__atomic_compare_exchange_n(&next_adapt_ns, &next, now + quarantine_adapt_ms*1000000ULL,
+                                  0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) return 0;
+  quarantine_adapt();
+  return 1;
+}
+
+#if ENABLE_DRAINER == 1
+static void *drainer(void *arg)
+{
+  for(;;){
+    pthread_mutex_lock(&drain_lock);
+    while(!__atomic_load_n(&drain_requested, __ATOMIC_ACQUIRE)){
+      if(!quarantine_adaptive){
+        pthread_cond_wait(&drain_cond, &drain_lock);
+        continue;
+      }
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += quarantine_adapt_ms / 1000;
+      deadline.tv_nsec += (quarantine_adapt_ms % 1000) * 1000000;
+      if(deadline.tv_nsec >= 1000000000){
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&drain_cond, &drain_lock, &deadline);
+      if(quarantine_adapt_due() && quarantine_over()) break;
+    }
+    pthread_mutex_unlock(&drain_lock);
+    __atomic_store_n(&drain_requested, 0, __ATOMIC_RELEASE);
+
+    // per tier: shards over their share first, then whatever is left (orphans)
+    Shard *all = __atomic_load_n(&all_shards, __ATOMIC_ACQUIRE);
+    for(int t = 0; t < QUARANTINE_TIERS; t++){
+      int64_t budget = tier_limit(t);
+      uint64_t share = quarantine_share(t);
+      for(Shard *s = all; s != NULL && tier_load(t) > budget; s = s->all_next){
+        evict_shard(s, t, s->orphan ? 0 : share, budget);
+      }
+      for(Shard *s = all; s != NULL && tier_load(t) > budget; s = s->all_next){
+        evict_shard(s, t, 0, budget);
+      }
+    }
+  }
+  return NULL;
+}
+
+static void start_drainer()
+{
+  pthread_t tid;
+  sigset_t all, old;
+
+  // the application's signals should never land on the drainer
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  pthread_create(&tid, NULL, drainer, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  pthread_detach(tid);
+}
+
+static void wake_drainer()
+{
+  if(__atomic_load_n(&drain_requested, __ATOMIC_RELAXED)) return;
+  if(__atomic_exchange_n(&drain_requested, 1, __ATOMIC_ACQ_REL)) return;
+  pthread_mutex_lock(&drain_lock);
+  pthread_cond_signal(&drain_cond);
+  pthread_mutex_unlock(&drain_lock);
+}
+#endif
+
+// the threads owning the other shards do not exist in the child
+static void quarantine_atfork_child()
+{
+  pthread_mutex_init(&orphan_lock, NULL);
+  orphans = NULL;
+  nr_shards = 0;
+  for(Shard *s = all_shards; s != NULL; s = s->all_next){
+    pthread_mutex_init(&s->lock, NULL);
+    if(s == my_shard){
+      nr_shards++;
+      continue;
+    }
+    s->orphan = 1;
+    s->next = orphans;
+    orphans = s;
+  }
+#if ENABLE_DRAINER == 1
+  pthread_mutex_init(&drain_lock, NULL);
+  pthread_cond_init(&drain_cond, NULL);
+  drain_requested = 0;
+  start_drainer();
+#endif
+}
+
+// double the committed part of a full ring, unwrapping it in the process.
+// Only the owner grows its rings, so `rear` cannot move meanwhile.
+static int grow_ring(Shard *s, int t)
+{
+  Tier *q = &s->tier[t];
+  int grown = 0;
+
+  pthread_mutex_lock(&s->lock);
+  size_t cap = q->cap;
+  size_t front = q->front;
+  size_t rear = q->rear;
+  size_t next = rear + 1 == cap ? 0 : rear + 1;
+  if(next == front && cap < tier_entries[t]){
+    size_t new_cap = cap*2 > tier_entries[t] ? tier_entries[t] : cap*2;
+    uintptr_t from = ((uintptr_t)(q->ring + cap)) & ~(uintptr_t)4095;
+    uintptr_t to = (uintptr_t)(q->ring + new_cap);
+    if(mprotect((void*)from, to - from, PROT_READ|PROT_WRITE) == 0){
+      // the wrapped part [0, rear) moves right behind the old end
+      if(rear < front){
+        size_t moved = rear < new_cap - cap ? rear : new_cap - cap;
+        memcpy(q->ring + cap, q->ring, moved*sizeof(Ring));
+        if(moved < rear) memmove(q->ring, q->ring + moved, (rear - moved)*sizeof(Ring));
+        rear = moved < rear ? rear - moved : cap + moved;
+        if(rear == new_cap) rear = 0;
+      }
+      q->cap = new_cap;
+      __atomic_store_n(&q->rear, rear, __ATOMIC_RELEASE);
+      grown = 1;
+    }
+  }
+  pthread_mutex_unlock(&s->lock);
+  return grown;
+}
+
+void append_to_list(Shard *s, int t, void *ptr, size_t size)
+{
+  Tier *q = &s->tier[t];
+  size_t rear, next;
+
+  // ring full: grow it, or make room ourselves
+  for(;;){
+    rear = q->rear;
+    next = rear + 1 == q->cap ? 0 : rear + 1;
+    if(next != __atomic_load_n(&q->front, __ATOMIC_ACQUIRE)) break;
+    if(!grow_ring(s, t)) evict_batch(s, t, INT64_MAX);
+  }
+
+  // enqueue
+  q->ring[rear].ptr = ptr;
+  q->ring[rear].size = size;
+  q->ring[rear].paged = poison_chunk(ptr, size);
+  __atomic_store_n(&q->rear, next, __ATOMIC_RELEASE);
+
+  __atomic_add_fetch(&q->size, size, __ATOMIC_RELAXED);
+  q->unflushed += size;
+  if(q->unflushed >= QUARANTINE_FLUSH_BYTES){
+    __atomic_add_fetch(&quarantine_size[t], q->unflushed, __ATOMIC_RELAXED);
+    q->unflushed = 0;
   }
 }
 
 void add_to_quarantine(void* ptr, size_t size)
 {
-  append_to_list(ptr, size);
+  int t = tier_of(size);
+  int64_t budget = tier_limit(t);
+
+  Shard *s = my_shard;
+  if(s == NULL && (int64_t)size <= budget) s = my_shard = new_shard();
+  // no shard, or it would flush its whole tier: release it right away
+  if(s == NULL || (int64_t)size > budget){
+    // slots go back to their free list, which expects them poisoned
+    if(in_slab(ptr)) poison_chunk(ptr, size);
+    release_chunk(ptr, size, 0);
+    return;
+  }
+
+  append_to_list(s, t, ptr, size);
 
-  //TODO: lock to read quarantine_size?
-  while(quarantine_size > QUARANTINE_SIZE_BYTES){
-    pop_last_from_list();
+#if ENABLE_DRAINER == 0
+  if(quarantine_adaptive && ++s->ticks >= QUARANTINE_ADAPT_TICKS){
+    s->ticks = 0;
+    quarantine_adapt_due();
   }
+#endif
+
+  budget = tier_limit(t);
+  int64_t total = tier_load(t) + s->tier[t].unflushed;
+  if(total <= budget) return;
+
+#if ENABLE_DRAINER == 1
+  // leave the eviction to the drainer, unless it is falling far behind
+  wake_drainer();
+  if(total <= QUARANTINE_BACKPRESSURE*budget) return;
+  evict_shard(s, t, 0, QUARANTINE_BACKPRESSURE*budget);
+#else
+  evict_shard(s, t, quarantine_share(t), budget);
+  if(orphans != NULL) drain_orphans();
+#endif
 }
 #endif
 
@@ -185,7 +1496,7 @@ proto_sysv_signal ___sysv_signal;
 
 sighandler_t signal(int signum, sighandler_t hndlr) {
     if(process){
-        if(signum == SIGFPE){
+        if(ENABLE_EXCEPTIONS && signum == SIGFPE){
             // return without registering
             return 0;
         }
@@ -196,7 +1507,7 @@ sighandler_t signal(int signum, sighandler_t hndlr) {
 // 600.perlbench calls __sysv_signal with signum==SIGFPE (depending on glibc)
 sighandler_t __sysv_signal(int signum, sighandler_t hndlr) {
     if(process){
-        if(signum == SIGFPE){
+        if(ENABLE_EXCEPTIONS && signum == SIGFPE){
             // return without registering
             return 0;
         }
@@ -207,7 +1518,7 @@ sighandler_t __sysv_signal(int signum, sighandler_t hndlr) {
 int sigaction(int signum, const struct sigaction *act, struct sigaction *oldact)
 {
     if(process){
-        if(signum == SIGFPE){
+        if(ENABLE_EXCEPTIONS && signum == SIGFPE){
             if(act != NULL && act->sa_sigaction != &handler){
                 // return without registering
                 return 0;
@@ -265,6 +1576,16 @@ void __attribute__ ((noinline, disable_sanitizer_instrumentation)) clear_stack_o
     memset((void*)g_stored_sp, 0, current_sp-g_stored_sp-8);
 }
 
+#if CHECK_CMP == 1
+static void cmp_fault(uint8_t *ptr);
+
+// the windows for which vaddss underflows on a redzone
+static inline __attribute__((always_inline)) void fpadd_magic(void *mem) {
+    uint32_t v;
+    memcpy(&v, mem, sizeof(v));
+    if(__builtin_expect(v == FLOAT_MAGIC_POISON || v == FLOAT_MAGIC_POISON_PRE, 0)) cmp_fault((uint8_t*)mem);
+}
+#else
 static inline __attribute__((always_inline)) void fpadd_magic(void *mem) {
     asm volatile (
     "vaddss %0, %1, %%xmm15"
@@ -272,6 +1593,7 @@ static inline __attribute__((always_inline)) void fpadd_magic(void *mem) {
     :"p"(mem), "v"(FLOAT_MAGIC_ADD)
     :"xmm15");
 }
+#endif
 
 static inline __attribute__((always_inline)) void apply_poison(void* ptr, size_t size)
 {
@@ -292,46 +1614,382 @@ static inline __attribute__((always_inline)) void apply_poison_overflow_delta(vo
     memset(poison+REDZONE_SIZE, 0x8b, delta);
 }
 
-static inline __attribute__((always_inline)) void remove_poison_scan(void* ptr) 
+static inline __attribute__((always_inline)) void remove_poison(void* ptr)
+{
+    Header* h = chunk_header(ptr);
+
+    // clear underflow redzone
+    memset(((uint8_t*)ptr) - REDZONE_SIZE, 0, REDZONE_SIZE);
+
+    // clear overflow redzone and the tail
+    memset(((uint8_t*)ptr) + h->size, 0, REDZONE_SIZE + h->slack);
+}
+
+// Vector scan for check_poison() on large ranges. Every vaddss that can
+// hit a redzone reads four 0x8b bytes (the 0x89 has 0x8b on its right), so
+// only the first window of four 0x8b bytes of each run needs one: the
+// handler walks left from there to the 0x89. Other data rarely contains
+// such runs, so big copies trap once per redzone instead of vaddss-ing
+// every REDZONE_SIZE/2 bytes.
+#define CHECK_SCAN_BYTES 256
+
+// Windows of four 0x8b bytes in the 64-byte block at b, restricted to
+// [p, end), as a bitmap of their first byte starting at b-3. `m` has a
+// bit per 0x8b byte of the block, `carry` those of the last 3 bytes of the
+// previous block.
+static inline uint64_t runs_of_four(uint64_t m, uint64_t* carry)
+{
+    unsigned __int128 ext = ((unsigned __int128)m << 3) | *carry;
+    *carry = m >> 61;
+    return (uint64_t)(ext & (ext >> 1) & (ext >> 2) & (ext >> 3));
+}
+
+static inline uint64_t poison_runs(uint8_t* b, uint8_t* p, uint8_t* end, uint64_t m, uint64_t* carry)
+{
+    if(b < p) m &= ~0ULL << (p - b);
+    if(end - b < 64) m &= (1ULL << (end - b)) - 1;
+    return runs_of_four(m, carry);
+}
+
+static uint8_t* find_poison_sse2(uint8_t* p, uint8_t* end)
+{
+    const __m128i rz = _mm_set1_epi8((char)FLOAT_MAGIC_POISON_BYTE);
+    uint64_t carry = 0;
+    for(uint8_t* b = (uint8_t*)((uintptr_t)p & ~(uintptr_t)63); b < end; b += 64){
+        uint64_t m = (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((__m128i*)b), rz))
+            | (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((__m128i*)(b + 16)), rz)) << 16
+            | (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((__m128i*)(b + 32)), rz)) << 32
+            | (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((__m128i*)(b + 48)), rz)) << 48;
+        uint64_t r = poison_runs(b, p, end, m, &carry);
+        if(r != 0) return b - 3 + __builtin_ctzll(r);
+    }
+    return NULL;
+}
+
+static __attribute__((target("avx2"))) uint8_t* find_poison_avx2(uint8_t* p, uint8_t* end)
+{
+    const __m256i rz = _mm256_set1_epi8((char)FLOAT_MAGIC_POISON_BYTE);
+    uint64_t carry = 0;
+    for(uint8_t* b = (uint8_t*)((uintptr_t)p & ~(uintptr_t)63); b < end; b += 64){
+        uint64_t m = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256((__m256i*)b), rz))
+            | (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256((__m256i*)(b + 32)), rz)) << 32;
+        uint64_t r = poison_runs(b, p, end, m, &carry);
+        if(r != 0) return b - 3 + __builtin_ctzll(r);
+    }
+    return NULL;
+}
+
+static __attribute__((target("avx512f,avx512bw"))) uint8_t* find_poison_avx512(uint8_t* p, uint8_t* end)
+{
+    const __m512i rz = _mm512_set1_epi8((char)FLOAT_MAGIC_POISON_BYTE);
+    uint64_t carry = 0;
+    for(uint8_t* b = (uint8_t*)((uintptr_t)p & ~(uintptr_t)63); b < end; b += 64){
+        uint64_t m = _mm512_cmpeq_epi8_mask(_mm512_load_si512((void*)b), rz);
+        uint64_t r = poison_runs(b, p, end, m, &carry);
+        if(r != 0) return b - 3 + __builtin_ctzll(r);
+    }
+    return NULL;
+}
+
+// picked at startup, see pick_kernels()
+static uint8_t* (*find_poison)(uint8_t* p, uint8_t* end) = find_poison_sse2;
+
+static void __attribute__((noinline)) check_poison_scan(uint8_t* p, uint8_t* end)
+{
+    while((p = find_poison(p, end)) != NULL){
+        fpadd_magic(p);
+        // not a redzone (or SURVIVE_EXCEPTIONS): skip the rest of the run
+        while(p < end && *p == FLOAT_MAGIC_POISON_BYTE) p++;
+    }
+}
+
+// Big ranges: the pages in the allocation index lie within a live payload,
+// so they hold no redzone and are skipped. The windows across the edge of
+// such a page have some payload in them, and are no redzone either.
+static void __attribute__((noinline)) check_poison_pages(uint8_t* p, uint8_t* end)
+{
+#if ENABLE_ALLOC_INDEX == 1
+    uint8_t* page = (uint8_t*)(((uintptr_t)p + 4095) & ~(uintptr_t)4095);
+    for(; page + 4096 <= end; page += 4096){
+        if(index_page((uintptr_t)page >> 12) == NULL) continue;
+        if(p < page) check_poison_scan(p, page);
+        p = page + 4096;
+    }
+#endif
+    if(p < end) check_poison_scan(p, end);
+}
+
+static inline __attribute__((always_inline)) void check_poison(void* src, size_t size);
+
+// Checked memcpy()/memset() in one pass, for ranges of CHECK_SCAN_BYTES on.
+// Each 64-byte block of the source and the destination is checked for
+// runs of 0x8b (see runs_of_four()) while it sits in registers, and a
+// block is only stored once the next one has been checked: a redzone
+// (0x89 and 15 bytes of 0x8b) is always reported before any of its bytes
+// gets overwritten. The tail goes through check_poison() and libc.
+
+// the windows of four 0x8b bytes of the block at offset `off`
+static void __attribute__((noinline, cold)) check_block(uint8_t* base, size_t off)
+{
+    check_poison_scan(base + (off != 0 ? off - 3 : 0), base + off + 64);
+}
+
+// Block with some 0x8b in the source (bitmap ms) or the destination (md),
+// or right after one ending with 0x8b. `carry` holds the carries of
+// runs_of_four() for both, the new ones are returned.
+static uint64_t __attribute__((noinline)) check_blocks(const uint8_t* src, uint8_t* dest, size_t off,
+                                                       uint64_t ms, uint64_t md, uint64_t carry)
+{
+    uint64_t cs = carry & 7, cd = carry >> 3;
+    if(src != NULL && runs_of_four(ms, &cs) != 0) check_block((uint8_t*)src, off);
+    if(runs_of_four(md, &cd) != 0) check_block(dest, off);
+    return cs | cd << 3;
+}
+
+static void copy_checked_sse2(uint8_t* dest, const uint8_t* src, size_t n)
+{
+    const __m128i rz = _mm_set1_epi8((char)FLOAT_MAGIC_POISON_BYTE);
+    __m128i a0 = _mm_setzero_si128(), a1 = a0, a2 = a0, a3 = a0;
+    uint64_t carry = 0;
+    size_t off;
+    for(off = 0; off + 64 <= n; off += 64){
+        __m128i s0 = _mm_loadu_si128((__m128i*)(src + off));
+        __m128i s1 = _mm_loadu_si128((__m128i*)(src + off + 16));
+        __m128i s2 = _mm_loadu_si128((__m128i*)(src + off + 32));
+        __m128i s3 = _mm_loadu_si128((__m128i*)(src + off + 48));
+        __m128i e0 = _mm_cmpeq_epi8(s0, rz), e1 = _mm_cmpeq_epi8(s1, rz);
+        __m128i e2 = _mm_cmpeq_epi8(s2, rz), e3 = _mm_cmpeq_epi8(s3, rz);
+        __m128i f0 = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)(dest + off)), rz);
+        __m128i f1 = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)(dest + off + 16)), rz);
+        __m128i f2 = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)(dest + off + 32)), rz);
+        __m128i f3 = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)(dest + off + 48)), rz);
+        __m128i any = _mm_or_si128(_mm_or_si128(_mm_or_si128(e0, e1), _mm_or_si128(e2, e3)),
+                                   _mm_or_si128(_mm_or_si128(f0, f1), _mm_or_si128(f2, f3)));
+        // no 0x8b at all, the common case: the carries stay 0
+        if(_mm_movemask_epi8(any) != 0 || carry != 0){
+            uint64_t ms = (uint64_t)_mm_movemask_epi8(e0) | (uint64_t)_mm_movemask_epi8(e1) << 16
+                | (uint64_t)_mm_movemask_epi8(e2) << 32 | (uint64_t)_mm_movemask_epi8(e3) << 48;
+            uint64_t md = (uint64_t)_mm_movemask_epi8(f0) | (uint64_t)_mm_movemask_epi8(f1) << 16
+                | (uint64_t)_mm_movemask_epi8(f2) << 32 | (uint64_t)_mm_movemask_epi8(f3) << 48;
+            carry = check_blocks(src, dest, off, ms, md, carry);
+        }
+        if(off != 0){
+            _mm_storeu_si128((__m128i*)(dest + off - 64), a0);
+            _mm_storeu_si128((__m128i*)(dest + off - 48), a1);
+            _mm_storeu_si128((__m128i*)(dest + off - 32), a2);
+            _mm_storeu_si128((__m128i*)(dest + off - 16), a3);
+        }
+        a0 = s0; a1 = s1; a2 = s2; a3 = s3;
+    }
+    check_poison((void*)(src + off - 3), n - off + 3);
+    check_poison(dest + off - 3, n - off + 3);
+    _mm_storeu_si128((__m128i*)(dest + off - 64), a0);
+    _mm_storeu_si128((__m128i*)(dest + off - 48), a1);
+    _mm_storeu_si128((__m128i*)(dest + off - 32), a2);
+    _mm_storeu_si128((__m128i*)(dest + off - 16), a3);
+    memcpy(dest + off, src + off, n - off);
+}
+
+// load the block at `off` into s0, s1 and check it along with the
+// destination block, see copy_checked_sse2()
+static inline __attribute__((always_inline, target("avx2"))) uint64_t load_checked_avx2(
+    uint8_t* dest, const uint8_t* src, size_t off, __m256i* s0, __m256i* s1, uint64_t carry)
+{
+    const __m256i rz = _mm256_set1_epi8((char)FLOAT_MAGIC_POISON_BYTE);
+    *s0 = _mm256_loadu_si256((__m256i*)(src + off));
+    *s1 = _mm256_loadu_si256((__m256i*)(src + off + 32));
+    __m256i e0 = _mm256_cmpeq_epi8(*s0, rz), e1 = _mm256_cmpeq_epi8(*s1, rz);
+    __m256i f0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i*)(dest + off)), rz);
+    __m256i f1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i*)(dest + off + 32)), rz);
+    __m256i any = _mm256_or_si256(_mm256_or_si256(e0, e1), _mm256_or_si256(f0, f1));
+    // no 0x8b at all, the common case: the carries stay 0
+    if(!_mm256_testz_si256(any, any) || carry != 0){
+        uint64_t ms = (uint32_t)_mm256_movemask_epi8(e0) | (uint64_t)(uint32_t)_mm256_movemask_epi8(e1) << 32;
+        uint64_t md = (uint32_t)_mm256_movemask_epi8(f0) | (uint64_t)(uint32_t)_mm256_movemask_epi8(f1) << 32;
+        carry = check_blocks(src, dest, off, ms, md, carry);
+    }
+    return carry;
+}
+
+// two blocks per iteration, each stored once the other one is checked
+static __attribute__((target("avx2"))) void copy_checked_avx2(uint8_t* dest, const uint8_t* src, size_t n)
+{
+    __m256i a0, a1, b0, b1;
+    uint64_t carry = load_checked_avx2(dest, src, 0, &a0, &a1, 0);
+    size_t off;
+    for(off = 64; off + 128 <= n; off += 128){
+        carry = load_checked_avx2(dest, src, off, &b0, &b1, carry);
+        _mm256_storeu_si256((__m256i*)(dest + off - 64), a0);
+        _mm256_storeu_si256((__m256i*)(dest + off - 32), a1);
+        carry = load_checked_avx2(dest, src, off + 64, &a0, &a1, carry);
+        _mm256_storeu_si256((__m256i*)(dest + off), b0);
+        _mm256_storeu_si256((__m256i*)(dest + off + 32), b1);
+    }
+    if(off + 64 <= n){
+        load_checked_avx2(dest, src, off, &b0, &b1, carry);
+        _mm256_storeu_si256((__m256i*)(dest + off - 64), a0);
+        _mm256_storeu_si256((__m256i*)(dest + off - 32), a1);
+        a0 = b0;
+        a1 = b1;
+        off += 64;
+    }
+    check_poison((void*)(src + off - 3), n - off + 3);
+    check_poison(dest + off - 3, n - off + 3);
+    _mm256_storeu_si256((__m256i*)(dest + off - 64), a0);
+    _mm256_storeu_si256((__m256i*)(dest + off - 32), a1);
+    memcpy(dest + off, src + off, n - off);
+}
+
+static void set_checked_sse2(uint8_t* dest, int c, size_t n)
+{
+    const __m128i rz = _mm_set1_epi8((char)FLOAT_MAGIC_POISON_BYTE);
+    const __m128i v = _mm_set1_epi8((char)c);
+    uint64_t carry = 0;
+    size_t off;
+    for(off = 0; off + 64 <= n; off += 64){
+        __m128i f0 = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)(dest + off)), rz);
+        __m128i f1 = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)(dest + off + 16)), rz);
+        __m128i f2 = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)(dest + off + 32)), rz);
+        __m128i f3 = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)(dest + off + 48)), rz);
+        __m128i any = _mm_or_si128(_mm_or_si128(f0, f1), _mm_or_si128(f2, f3));
+        if(_mm_movemask_epi8(any) != 0 || carry != 0){
+            uint64_t md = (uint64_t)_mm_movemask_epi8(f0) | (uint64_t)_mm_movemask_epi8(f1) << 16
+                | (uint64_t)_mm_movemask_epi8(f2) << 32 | (uint64_t)_mm_movemask_epi8(f3) << 48;
+            carry = check_blocks(NULL, dest, off, 0, md, carry);
+        }
+        if(off != 0){
+            _mm_storeu_si128((__m128i*)(dest + off - 64), v);
+            _mm_storeu_si128((__m128i*)(dest + off - 48), v);
+            _mm_storeu_si128((__m128i*)(dest + off - 32), v);
+            _mm_storeu_si128((__m128i*)(dest + off - 16), v);
+        }
+    }
+    check_poison(dest + off - 3, n - off + 3);
+    _mm_storeu_si128((__m128i*)(dest + off - 64), v);
+    _mm_storeu_si128((__m128i*)(dest + off - 48), v);
+    _mm_storeu_si128((__m128i*)(dest + off - 32), v);
+    _mm_storeu_si128((__m128i*)(dest + off - 16), v);
+    memset(dest + off, c, n - off);
+}
+
+static __attribute__((target("avx2"))) void set_checked_avx2(uint8_t* dest, int c, size_t n)
+{
+    const __m256i rz = _mm256_set1_epi8((char)FLOAT_MAGIC_POISON_BYTE);
+    const __m256i v = _mm256_set1_epi8((char)c);
+    uint64_t carry = 0;
+    size_t off;
+    for(off = 0; off + 64 <= n; off += 64){
+        __m256i f0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i*)(dest + off)), rz);
+        __m256i f1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i*)(dest + off + 32)), rz);
+        __m256i any = _mm256_or_si256(f0, f1);
+        if(!_mm256_testz_si256(any, any) || carry != 0){
+            uint64_t md = (uint32_t)_mm256_movemask_epi8(f0) | (uint64_t)(uint32_t)_mm256_movemask_epi8(f1) << 32;
+            carry = check_blocks(NULL, dest, off, 0, md, carry);
+        }
+        if(off != 0){
+            _mm256_storeu_si256((__m256i*)(dest + off - 64), v);
+            _mm256_storeu_si256((__m256i*)(dest + off - 32), v);
+        }
+    }
+    check_poison(dest + off - 3, n - off + 3);
+    _mm256_storeu_si256((__m256i*)(dest + off - 64), v);
+    _mm256_storeu_si256((__m256i*)(dest + off - 32), v);
+    memset(dest + off, c, n - off);
+}
+
+// a block in one register, and the bitmaps straight from the compare
+static inline __attribute__((always_inline, target("avx512f,avx512bw"))) uint64_t load_checked_avx512(
+    uint8_t* dest, const uint8_t* src, size_t off, __m512i* s, uint64_t carry)
 {
-    // assume ptr is already shifted back to the original start of the obj
-    size_t sz = malloc_usable_size(ptr);
+    const __m512i rz = _mm512_set1_epi8((char)FLOAT_MAGIC_POISON_BYTE);
+    *s = _mm512_loadu_si512((void*)(src + off));
+    uint64_t ms = _mm512_cmpeq_epi8_mask(*s, rz);
+    uint64_t md = _mm512_cmpeq_epi8_mask(_mm512_loadu_si512((void*)(dest + off)), rz);
+    if((ms | md | carry) != 0) carry = check_blocks(src, dest, off, ms, md, carry);
+    return carry;
+}
 
-    // clear underflow redzone
-    memset(ptr, 0, REDZONE_SIZE);
-
-    // find the start of the overflow redzone
-    uint8_t* b = ((uint8_t*)ptr) + sz;
-    size_t i;
-    for(i = REDZONE_SIZE; i < sz; i++){
-        if(*(b-i) != 0x8b){
-            break;
-        }
+static __attribute__((target("avx512f,avx512bw"))) void copy_checked_avx512(uint8_t* dest, const uint8_t* src, size_t n)
+{
+    __m512i a, b;
+    uint64_t carry = load_checked_avx512(dest, src, 0, &a, 0);
+    size_t off;
+    for(off = 64; off + 128 <= n; off += 128){
+        carry = load_checked_avx512(dest, src, off, &b, carry);
+        _mm512_storeu_si512((void*)(dest + off - 64), a);
+        carry = load_checked_avx512(dest, src, off + 64, &a, carry);
+        _mm512_storeu_si512((void*)(dest + off), b);
     }
-    // here *b-i == 0x89. clear overflow redzone
-    memset(b-i, 0, i);
+    if(off + 64 <= n){
+        load_checked_avx512(dest, src, off, &b, carry);
+        _mm512_storeu_si512((void*)(dest + off - 64), a);
+        a = b;
+        off += 64;
+    }
+    check_poison((void*)(src + off - 3), n - off + 3);
+    check_poison(dest + off - 3, n - off + 3);
+    _mm512_storeu_si512((void*)(dest + off - 64), a);
+    memcpy(dest + off, src + off, n - off);
 }
 
-// check_poison externally visible
-void __attribute__ ((noinline)) check_poison_visible(void* src, size_t size)
+static __attribute__((target("avx512f,avx512bw"))) void set_checked_avx512(uint8_t* dest, int c, size_t n)
 {
-    // these calls do not check the size as pre-condition
-    if(size == 0) return;
+    const __m512i rz = _mm512_set1_epi8((char)FLOAT_MAGIC_POISON_BYTE);
+    const __m512i v = _mm512_set1_epi8((char)c);
+    uint64_t carry = 0;
+    size_t off;
+    for(off = 0; off + 64 <= n; off += 64){
+        uint64_t md = _mm512_cmpeq_epi8_mask(_mm512_loadu_si512((void*)(dest + off)), rz);
+        if((md | carry) != 0) carry = check_blocks(NULL, dest, off, 0, md, carry);
+        if(off != 0) _mm512_storeu_si512((void*)(dest + off - 64), v);
+    }
+    check_poison(dest + off - 3, n - off + 3);
+    _mm512_storeu_si512((void*)(dest + off - 64), v);
+    memset(dest + off, c, n - off);
+}
 
-    size_t src_b = (size_t)src;
+// picked at startup, see pick_kernels()
+static void (*copy_checked)(uint8_t* dest, const uint8_t* src, size_t n) = copy_checked_sse2;
+static void (*set_checked)(uint8_t* dest, int c, size_t n) = set_checked_sse2;
 
-    for(size_t ptr=src_b; ptr<src_b+size; ptr+=REDZONE_SIZE/2) {
-        fpadd_magic((char *) ptr);
-    }
+// Widest kernels the CPU runs, capped by FLOATZONE_OPTIONS isa=... (e.g.
+// isa=avx2 where 512-bit code lowers the clock). SSE2 is the baseline of
+// x86-64, so the same libwrap.so loads everywhere.
+#define ISA_SSE2   0
+#define ISA_AVX2   1
+#define ISA_AVX512 2
+static int isa_max = ISA_AVX512;
 
-    //Always check rightmost 4 bytes
-    fpadd_magic((char *) (src_b + size - 1));
+static void pick_kernels()
+{
+    __builtin_cpu_init();
+    if(isa_max >= ISA_AVX512 && __builtin_cpu_supports("avx512bw")){
+        find_poison = find_poison_avx512;
+        copy_checked = copy_checked_avx512;
+        set_checked = set_checked_avx512;
+        stream_fill = stream_fill_avx512;
+    }
+    else if(isa_max >= ISA_AVX2 && __builtin_cpu_supports("avx2")){
+        find_poison = find_poison_avx2;
+        copy_checked = copy_checked_avx2;
+        set_checked = set_checked_avx2;
+        stream_fill = stream_fill_avx2;
+    }
 }
 
 static inline __attribute__((always_inline)) void check_poison(void* src, size_t size)
 {
     size_t src_b = (size_t)src;
 
+    if(size >= CHECK_SCAN_BYTES){
+        // within a live heap object
+        if(index_covers(src, size)) return;
+        check_poison_pages((uint8_t*)src, (uint8_t*)src + size);
+        // redzones cut by the end of the range
+        fpadd_magic((char *) (src_b + size - 1));
+        return;
+    }
+
     //Always check leftmost byte (first iteration) and
     //then check every REDZONE_SIZE
     //TODO verify properly that we need REDZONE_SIZE/2 steps
@@ -343,22 +2001,122 @@ static inline __attribute__((always_inline)) void check_poison(void* src, size_t
     fpadd_magic((char *) (src_b + size - 1));
 }
 
-void* malloc(size_t size)
+// check_poison externally visible
+void __attribute__ ((noinline)) check_poison_visible(void* src, size_t size)
 {
-    if(process){
-        if(size == 0) return NULL;
+    // these calls do not check the size as pre-condition
+    if(size == 0) return;
 
-        size_t padded_size = REDZONE_SIZE + size + REDZONE_SIZE;
-        uint8_t* ptr = __libc_malloc(padded_size);
-        if(ptr == NULL) return NULL;
+    check_poison(src, size);
+}
+
+// Large chunks get their own mapping. Only the first page (header and
+// underflow redzone) and the last ones (overflow redzone and tail) are
+// written: the payload stays on the kernel's zero page until the
+// application touches it, which also makes calloc() free.
+static void* large_malloc(size_t size)
+{
+    if(size > SIZE_MAX - CHUNK_PADDING - 4095){
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t len = (CHUNK_PADDING + size + 4095) & ~(size_t)4095;
+    if(len - CHUNK_PADDING - size > UINT32_MAX) return NULL;
 
-        apply_poison_underflow(ptr);
-        size_t allocated_size = malloc_usable_size(ptr);
+    uint8_t* chunk = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(chunk == MAP_FAILED) return NULL;
 
-        ptr = ptr + REDZONE_SIZE; // shift by underflow redzone
-        apply_poison_overflow_delta(ptr, size, allocated_size-padded_size);
+    uint8_t* ptr = chunk + CHUNK_PAYLOAD;
+    set_header(ptr, size, len - CHUNK_PADDING - size);
+    chunk_header(ptr)->flags = CHUNK_MMAP;
+    apply_poison_underflow(ptr - REDZONE_SIZE);
+    apply_poison_overflow_delta(ptr, size, len - CHUNK_PADDING - size);
+    index_add(ptr, size);
 
-        return (void *)ptr;
+    return (void *)ptr;
+}
+
+// Grow or shrink a large chunk with mremap(), which moves the page table
+// entries instead of copying the payload. Only the old overflow redzone and
+// tail are cleared, the new pages are zero already.
+static void* large_realloc(void* ptr, size_t size)
+{
+    Header* h = chunk_header(ptr);
+    size_t old_size = h->size;
+    size_t old_len = chunk_usable(h);
+
+    if(size > SIZE_MAX - CHUNK_PADDING - 4095){
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t len = (CHUNK_PADDING + size + 4095) & ~(size_t)4095;
+    if(len - CHUNK_PADDING - size > UINT32_MAX) return NULL;
+
+    index_remove(ptr, old_size);
+    memset(((uint8_t*)ptr) + old_size, 0, REDZONE_SIZE + h->slack);
+    uint8_t* chunk = mremap(h, old_len, len, MREMAP_MAYMOVE);
+    if(chunk == MAP_FAILED){
+        // the old object stays valid
+        apply_poison_overflow_delta(ptr, old_size, h->slack);
+        index_add(ptr, old_size);
+        return NULL;
+    }
+
+    ptr = chunk + CHUNK_PAYLOAD;
+    set_header(ptr, size, len - CHUNK_PADDING - size);
+    chunk_header(ptr)->flags = CHUNK_MMAP;
+    apply_poison_overflow_delta(ptr, size, len - CHUNK_PADDING - size);
+    index_add(ptr, size);
+
+    return ptr;
+}
+
+static inline void* heap_malloc(size_t size)
+{
+    if(size == 0) return NULL;
+    if(size > SIZE_MAX - CHUNK_PADDING){
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if(size >= LARGE_ALLOC_BYTES) return large_malloc(size);
+
+    if(slab_enabled && size <= SLAB_MAX_SIZE){
+        void* slot = slab_alloc(size);
+        if(slot != NULL) return slot;
+    }
+
+#if ENABLE_QUARANTINE == 1 && ENABLE_RECYCLE == 1
+    void* recycled = recycle_pop(size);
+    if(recycled != NULL) return recycled;
+#endif
+
+    size_t padded_size = CHUNK_PADDING + size;
+    uint8_t* ptr = backend.malloc(padded_size);
+    if(ptr == NULL) return NULL;
+
+    size_t allocated_size = backend.usable_size(ptr);
+
+    ptr = ptr + CHUNK_PAYLOAD; // shift by header and underflow redzone
+    set_header(ptr, size, allocated_size-padded_size);
+    apply_poison_underflow(ptr - REDZONE_SIZE);
+    apply_poison_overflow_delta(ptr, size, allocated_size-padded_size);
+    index_add(ptr, size);
+
+    return (void *)ptr;
+}
+
+// site: return address of the allocation call, for sample_sites
+static inline void* sampled_malloc(size_t size, void* site)
+{
+    if(sampling && !sample(size, site)) return plain_malloc(size);
+    return heap_malloc(size);
+}
+
+void* malloc(size_t size)
+{
+    if(process){
+        return sampled_malloc(size, __builtin_return_address(0));
     }
     return __libc_malloc(size);
 }
@@ -366,19 +2124,40 @@ void* malloc(size_t size)
 void* calloc(size_t nmemb, size_t size)
 {
     if(process){
-        // easier to pad calloc by relying on malloc
-        size_t total_size = nmemb * size;
+        size_t total_size;
+        if(__builtin_mul_overflow(nmemb, size, &total_size)){
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        if(sampling && !sample(total_size, __builtin_return_address(0))) return plain_calloc(total_size);
+
+        // zero pages
+        if(total_size >= LARGE_ALLOC_BYTES) return large_malloc(total_size);
+
+        // zeroed already
+        if(slab_enabled && total_size != 0 && total_size <= SLAB_MAX_SIZE){
+            void* slot = slab_alloc(total_size);
+            if(slot != NULL) return slot;
+        }
+
+#if ENABLE_QUARANTINE == 1 && ENABLE_RECYCLE == 1
+        // zeroed already
+        void* recycled = recycle_pop(total_size);
+        if(recycled != NULL) return recycled;
+#endif
 
-        size_t padded_size = REDZONE_SIZE + total_size + REDZONE_SIZE;
-        uint8_t* ptr = __libc_malloc(padded_size);
+        size_t padded_size = CHUNK_PADDING + total_size;
+        uint8_t* ptr = backend.calloc(1, padded_size); // zero out (calloc)
         if(ptr == NULL) return NULL;
 
-        apply_poison_underflow(ptr);
-        size_t allocated_size = malloc_usable_size(ptr);
+        size_t allocated_size = backend.usable_size(ptr);
 
-        ptr = ptr + REDZONE_SIZE; // shift by underflow redzone
-        memset(ptr, 0, total_size); // zero out (calloc)
+        ptr = ptr + CHUNK_PAYLOAD; // shift by header and underflow redzone
+        set_header(ptr, total_size, allocated_size-padded_size);
+        apply_poison_underflow(ptr - REDZONE_SIZE);
         apply_poison_overflow_delta(ptr, total_size, allocated_size-padded_size);
+        index_add(ptr, total_size);
 
         return (void *)ptr;
     }
@@ -389,7 +2168,7 @@ void* realloc(void *ptr, size_t size)
 {
     if(process){
         if(ptr == NULL){
-            return malloc(size);
+            return sampled_malloc(size, __builtin_return_address(0));
         }
 
         if(size == 0){
@@ -397,27 +2176,125 @@ void* realloc(void *ptr, size_t size)
             return NULL;
         }
 
-        // recover original address
-        ptr = ptr - REDZONE_SIZE;
+        // the padded size below must not wrap around
+        if(size > SIZE_MAX - CHUNK_PADDING){
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        if(sampling && chunk_plain(ptr)) return plain_realloc(ptr, size);
+
+        Header* h = chunk_header(ptr);
+        size_t old_size = h->size;
+        size_t usable = chunk_usable(h);
+        size_t padded_size = CHUNK_PADDING + size;
+
+        // still fits the chunk, and uses at least half of it: resize in place
+        if(padded_size <= usable && padded_size >= usable/2 && usable - padded_size <= UINT32_MAX){
+            index_remove(ptr, old_size);
+            if(size > old_size){
+                // the old redzone and tail become payload
+                memset(((uint8_t*)ptr) + old_size, 0, size - old_size);
+            }
+            else {
+                // the end of the old payload becomes tail
+                memset(((uint8_t*)ptr) + size + REDZONE_SIZE, FLOAT_MAGIC_POISON_BYTE, old_size - size);
+            }
+            apply_poison(ptr, size);
+            h->size = size;
+            h->slack = usable - padded_size;
+            index_add(ptr, size);
+            return ptr;
+        }
+
+        if((h->flags & CHUNK_MMAP) && size >= LARGE_ALLOC_BYTES){
+            return large_realloc(ptr, size);
+        }
+
+        // slots, aligned and mapped chunks cannot be resized by the backend,
+        // and large requests get mapped
+        if(in_slab(ptr) || (h->flags & (CHUNK_ALIGNED|CHUNK_MMAP)) || size >= LARGE_ALLOC_BYTES){
+            void* moved = malloc(size);
+            if(moved == NULL) return NULL;
+            memcpy(moved, ptr, old_size < size ? old_size : size);
+            free(ptr);
+            return moved;
+        }
+
+#if ENABLE_QUARANTINE == 1 && ENABLE_RECYCLE == 1
+        // move to a recycled chunk, the old one goes to the quarantine
+        void* recycled = recycle_pop(size);
+        if(recycled != NULL){
+            memcpy(recycled, ptr, old_size < size ? old_size : size);
+            free(ptr);
+            return recycled;
+        }
+#endif
 
         // make sure the old redzone does not get copied to the new object
-        remove_poison_scan(ptr);
+        remove_poison(ptr);
+        index_remove(ptr, old_size);
 
-        size_t padded_size = REDZONE_SIZE + size + REDZONE_SIZE;
-        void* reptr = __libc_realloc(ptr, padded_size);
-        if(reptr == NULL) return NULL;
+        // recover original address
+        uint8_t* reptr = backend.realloc(((uint8_t*)ptr) - CHUNK_PAYLOAD, padded_size);
+        if(reptr == NULL){
+            // the old object stays valid
+            apply_poison_underflow(((uint8_t*)ptr) - REDZONE_SIZE);
+            apply_poison_overflow_delta(ptr, old_size, usable - CHUNK_PADDING - old_size);
+            index_add(ptr, old_size);
+            return NULL;
+        }
 
-        apply_poison_underflow(reptr);
-        size_t allocated_size = malloc_usable_size(reptr);
+        size_t allocated_size = backend.usable_size(reptr);
 
-        reptr = reptr + REDZONE_SIZE; // shift by underflow redzone
+        reptr = reptr + CHUNK_PAYLOAD; // shift by header and underflow redzone
+        set_header(reptr, size, allocated_size-padded_size);
+        apply_poison_underflow(reptr - REDZONE_SIZE);
         apply_poison_overflow_delta(reptr, size, allocated_size-padded_size);
+        index_add(reptr, size);
 
         return reptr;
     }
     return __libc_realloc(ptr, size);
 }
 
+// free() past the double free check
+static inline __attribute__((always_inline)) void free_payload(void* ptr)
+{
+    if(sampling && chunk_plain(ptr)){
+        plain_free(ptr);
+        return;
+    }
+
+    index_remove(ptr, chunk_header(ptr)->size);
+
+    size_t usable;
+#if ENABLE_QUARANTINE == 1
+    // recover original address
+    uint8_t* chunk = chunk_start(ptr, &usable);
+    if(chunk != (uint8_t*)chunk_header(ptr)){
+        // aligned: the quarantine expects the plain layout from the chunk start
+        *((Header*)chunk) = (Header){ usable - CHUNK_PADDING, 0, 0, CHUNK_MAGIC };
+        apply_poison_underflow(chunk + sizeof(Header));
+    }
+    add_to_quarantine(chunk, usable);
+#else
+    if(in_slab(ptr)){
+        // poison the payload, and the 0x89 behind it, again
+        memset(ptr, FLOAT_MAGIC_POISON_BYTE, chunk_header(ptr)->size + 1);
+        slab_release(((uint8_t*)ptr) - CHUNK_PAYLOAD);
+        return;
+    }
+    uint8_t* chunk = chunk_start(ptr, &usable);
+    if(chunk_header(ptr)->flags & CHUNK_MMAP){
+        munmap(chunk, usable);
+        return;
+    }
+    remove_poison(ptr);
+    backend_free(chunk, usable);
+#endif
+}
+
 void free(void* ptr)
 {
     if(process){
@@ -426,37 +2303,255 @@ void free(void* ptr)
         // double free check
         fpadd_magic(ptr);
 
-        // recover original address
-        ptr = ptr - REDZONE_SIZE;
+        free_payload(ptr);
+        return;
+    }
+    __libc_free(ptr);
+}
 
-#if ENABLE_QUARANTINE == 1
-        size_t sz = malloc_usable_size(ptr);
-        add_to_quarantine(ptr, sz);
+// Print the backtrace, without the innermost `skip` frames (the runtime's
+// own), and stop the program
+static inline __attribute__((always_inline)) void report_backtrace(int skip)
+{
+    void **buf = malloc(128*sizeof(void *));
+    int ret = backtrace(buf, 128);
+    char **names = backtrace_symbols(buf, ret);
+    fprintf(stderr, "Backtrace:\n");
+    for(int i=skip; i<ret; i++) {
+        fprintf(stderr, " - [%d] %s\n", i-skip, names[i]);
+    }
+
+#if FUZZ_MODE == 1
+    abort();
 #else
-        remove_poison_scan(ptr);
-        __libc_free(ptr);
+    exit(FAULT_ERROR_CODE);
+#endif
+}
+
+// Sized deallocation must pass the size the object was allocated with
+// (operator new(0) allocates 1 byte).
+static void __attribute__((noinline)) check_free_size(void* ptr, size_t size)
+{
+    size_t allocated = sampling && chunk_plain(ptr) ? ((Header*)ptr - 1)->size : chunk_header(ptr)->size;
+    if(allocated == size || (size == 0 && allocated == 1)) return;
+
+#if SURVIVE_EXCEPTIONS == 0
+    fprintf(stderr, "\n!!!! [FLOATZONE] Sized free of %p with size %zu, allocated with %zu !!!!\n", ptr, size, allocated);
+    report_backtrace(1);
+#endif
+}
+
+// Aligned deallocation must pass an alignment the payload has. The
+// alignment itself is not kept, but aligned_malloc() only moves the payload
+// (CHUNK_ALIGNED) for alignments above 16.
+static void __attribute__((noinline)) check_free_alignment(void* ptr, size_t alignment)
+{
+    int moved = !(sampling && chunk_plain(ptr)) && (chunk_header(ptr)->flags & CHUNK_ALIGNED);
+    if(alignment != 0 && (alignment & (alignment - 1)) == 0 &&
+       ((uintptr_t)ptr & (alignment - 1)) == 0 && (!moved || alignment > 16)) return;
+
+#if SURVIVE_EXCEPTIONS == 0
+    fprintf(stderr, "\n!!!! [FLOATZONE] Aligned free of %p with alignment %zu !!!!\n", ptr, alignment);
+    report_backtrace(1);
 #endif
+}
+
+// C23
+void free_sized(void* ptr, size_t size)
+{
+    if(process){
+        if(ptr == NULL) return;
+
+        // double free check
+        fpadd_magic(ptr);
+
+        check_free_size(ptr, size);
+        free_payload(ptr);
         return;
     }
     __libc_free(ptr);
 }
 
+void free_aligned_sized(void* ptr, size_t alignment, size_t size)
+{
+    if(process && ptr != NULL){
+        // double free check, before the header is trusted
+        fpadd_magic(ptr);
+
+        check_free_alignment(ptr, alignment);
+    }
+    free_sized(ptr, size);
+}
+
 typedef int (*proto_posix_memalign)(void **memptr, size_t alignment, size_t size);
 proto_posix_memalign __posix_memalign;
 
+// Payload aligned to `alignment` (a power of two): the header and the
+// underflow redzone go at the end of the alignment padding, and the start
+// of the backend chunk right before the header.
+static void* aligned_malloc(size_t alignment, size_t size)
+{
+    if(alignment <= 16) return malloc(size);
+    if(size == 0) return NULL;
+    if(size > SIZE_MAX - CHUNK_PADDING - alignment){
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    size_t padded_size = CHUNK_PADDING + size + alignment - 16;
+    uint8_t* chunk = backend.malloc(padded_size);
+    if(chunk == NULL) return NULL;
+
+    size_t allocated_size = backend.usable_size(chunk);
+
+    uint8_t* ptr = (uint8_t*)(((uintptr_t)chunk + CHUNK_PAYLOAD + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    size_t offset = (ptr - CHUNK_PAYLOAD) - chunk; // 0 or at least 16
+    size_t slack = allocated_size - offset - CHUNK_PADDING - size;
+    set_header(ptr, size, slack);
+    if(offset != 0){
+        chunk_header(ptr)->flags = CHUNK_ALIGNED;
+        ((uint8_t**)chunk_header(ptr))[-1] = chunk;
+    }
+    apply_poison_underflow(ptr - REDZONE_SIZE);
+    apply_poison_overflow_delta(ptr, size, slack);
+    index_add(ptr, size);
+
+    return (void *)ptr;
+}
+
 int __attribute__((disable_sanitizer_instrumentation)) posix_memalign(void **memptr, size_t alignment, size_t size)
 {
     if(process){
-		    *memptr = malloc(size);
-		    if(*memptr != NULL) return 0;
-		    return 12; // ENOMEM
+		    if(alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) return EINVAL;
+		    *memptr = aligned_malloc(alignment, size);
+		    if(*memptr != NULL || size == 0) return 0;
+		    return ENOMEM;
 	  }
 	  return __posix_memalign(memptr, alignment, size);
 }
 
+void* __attribute__((disable_sanitizer_instrumentation)) aligned_alloc(size_t alignment, size_t size)
+{
+    if(process){
+        if(alignment == 0 || (alignment & (alignment - 1)) != 0){
+            errno = EINVAL;
+            return NULL;
+        }
+        return aligned_malloc(alignment, size);
+    }
+    return __libc_memalign(alignment, size);
+}
+
+void* __attribute__((disable_sanitizer_instrumentation)) memalign(size_t alignment, size_t size)
+{
+    if(process){
+        // like glibc, round up to a power of two
+        if(alignment > SIZE_MAX/2 + 1){
+            errno = EINVAL;
+            return NULL;
+        }
+        size_t align = 1;
+        while(align < alignment) align <<= 1;
+        return aligned_malloc(align, size);
+    }
+    return __libc_memalign(alignment, size);
+}
+
+void* __attribute__((disable_sanitizer_instrumentation)) valloc(size_t size)
+{
+    if(process){
+        return aligned_malloc(sysconf(_SC_PAGESIZE), size);
+    }
+    return __libc_valloc(size);
+}
+
+void* __attribute__((disable_sanitizer_instrumentation)) pvalloc(size_t size)
+{
+    if(process){
+        size_t page = sysconf(_SC_PAGESIZE);
+        if(size == 0) size = 1;
+        return aligned_malloc(page, (size + page - 1) & ~(page - 1));
+    }
+    return __libc_pvalloc(size);
+}
+
+// C++ operator new/delete (Itanium mangling, std::align_val_t is passed as
+// a size_t and std::nothrow_t by reference). Sized delete hands the size
+// over to the same checks as free_sized() and free_aligned_sized(). The
+// real operators (resolved lazily, new can run before __libc_start_main)
+// only handle the calls outside the process and the allocation failures:
+// they retry through malloc()/aligned_alloc(), run the new_handler and
+// throw std::bad_alloc.
+typedef void* (*proto_new)(size_t size);
+typedef void* (*proto_new_nothrow)(size_t size, const void* tag);
+typedef void* (*proto_new_aligned)(size_t size, size_t alignment);
+typedef void* (*proto_new_aligned_nothrow)(size_t size, size_t alignment, const void* tag);
+
+static void* og_operator(void** og, const char* sym)
+{
+    if(*og == NULL) *og = dlsym(RTLD_NEXT, sym);
+    return *og;
+}
+
+#define OPERATOR_NEW(mangled)                                              \
+void* mangled(size_t size)                                                 \
+{                                                                          \
+    static void* og;                                                       \
+    if(process){                                                           \
+        void* ptr = sampled_malloc(size ? size : 1, __builtin_return_address(0)); \
+        if(ptr != NULL) return ptr;                                        \
+    }                                                                      \
+    return ((proto_new)og_operator(&og, #mangled))(size);                  \
+}                                                                          \
+void* mangled##RKSt9nothrow_t(size_t size, const void* tag)                \
+{                                                                          \
+    static void* og;                                                       \
+    if(process){                                                           \
+        void* ptr = sampled_malloc(size ? size : 1, __builtin_return_address(0)); \
+        if(ptr != NULL) return ptr;                                        \
+    }                                                                      \
+    return ((proto_new_nothrow)og_operator(&og, #mangled "RKSt9nothrow_t"))(size, tag); \
+}                                                                          \
+void* mangled##St11align_val_t(size_t size, size_t alignment)              \
+{                                                                          \
+    static void* og;                                                       \
+    if(process){                                                           \
+        void* ptr = aligned_malloc(alignment, size ? size : 1);            \
+        if(ptr != NULL) return ptr;                                        \
+    }                                                                      \
+    return ((proto_new_aligned)og_operator(&og, #mangled "St11align_val_t"))(size, alignment); \
+}                                                                          \
+void* mangled##St11align_val_tRKSt9nothrow_t(size_t size, size_t alignment, const void* tag) \
+{                                                                          \
+    static void* og;                                                       \
+    if(process){                                                           \
+        void* ptr = aligned_malloc(alignment, size ? size : 1);            \
+        if(ptr != NULL) return ptr;                                        \
+    }                                                                      \
+    return ((proto_new_aligned_nothrow)og_operator(&og, #mangled "St11align_val_tRKSt9nothrow_t"))(size, alignment, tag); \
+}
+
+#define OPERATOR_DELETE(mangled)                                           \
+void mangled(void* ptr) { free(ptr); }                                     \
+void mangled##m(void* ptr, size_t size) { free_sized(ptr, size); }         \
+void mangled##RKSt9nothrow_t(void* ptr, const void* tag) { (void)tag; free(ptr); } \
+void mangled##St11align_val_t(void* ptr, size_t alignment) { (void)alignment; free(ptr); } \
+void mangled##mSt11align_val_t(void* ptr, size_t size, size_t alignment) { free_aligned_sized(ptr, alignment, size); } \
+void mangled##St11align_val_tRKSt9nothrow_t(void* ptr, size_t alignment, const void* tag) { (void)alignment; (void)tag; free(ptr); }
+
+OPERATOR_NEW(_Znwm)     // new
+OPERATOR_NEW(_Znam)     // new[]
+OPERATOR_DELETE(_ZdlPv) // delete
+OPERATOR_DELETE(_ZdaPv) // delete[]
+
 void __attribute__((disable_sanitizer_instrumentation)) *floatzone_memcpy(void *dest, const void * src, size_t n)
 {
     if(process){
+        if(n >= CHECK_SCAN_BYTES){
+            if(index_covers((void*)src, n) && index_covers(dest, n)) return memcpy(dest, src, n);
+            copy_checked(dest, src, n);
+            return dest;
+        }
         // naive pre-memcpy checks (instead of inter-memcpy)
         if(n != 0){
             check_poison((void*)src, n);
@@ -469,6 +2564,11 @@ void __attribute__((disable_sanitizer_instrumentation)) *floatzone_memcpy(void *
 void* __attribute__((disable_sanitizer_instrumentation)) floatzone_memset(void *str, int c, size_t n)
 {
     if(process){
+        if(n >= CHECK_SCAN_BYTES){
+            if(index_covers(str, n)) return memset(str, c, n);
+            set_checked(str, c, n);
+            return str;
+        }
         // naive pre-memset checks (instead of inter-memset)
         if(n != 0){
             check_poison(str, n);
@@ -480,6 +2580,12 @@ void* __attribute__((disable_sanitizer_instrumentation)) floatzone_memset(void *
 void* __attribute__((disable_sanitizer_instrumentation)) floatzone_memmove(void *str1, const void *str2, size_t n)
 {
     if(process){
+        if(n >= CHECK_SCAN_BYTES && index_covers((void*)str2, n) && index_covers(str1, n)) return memmove(str1, str2, n);
+        // forward copy, unless the buffers overlap
+        if(n >= CHECK_SCAN_BYTES && ((uint8_t*)str1 + n <= (uint8_t*)str2 || (uint8_t*)str2 + n <= (uint8_t*)str1)){
+            copy_checked(str1, str2, n);
+            return str1;
+        }
         // naive pre-memmove checks (instead of inter-memmove)
         if(n != 0){
             check_poison((void*)str2, n);
@@ -489,42 +2595,239 @@ void* __attribute__((disable_sanitizer_instrumentation)) floatzone_memmove(void
     return memmove(str1, str2, n);
 }
 
-int __attribute__((disable_sanitizer_instrumentation)) floatzone_strcmp(const char *s1, const char *s2)
+// String kernels: find the terminator (or the first difference), check for
+// redzones and do the operation in one pass, 16 bytes at a time since most
+// strings are short. The 0x8b bitmaps go through runs_of_four() as in
+// copy_checked_sse2(), with the carry of a 16-byte chunk. Unaligned chunks
+// are only loaded when they stay within a page, or once a byte loop found
+// no terminator in them: a string may end right before an unmapped page.
+// Past CHECK_SCAN_BYTES, the rest of a string goes through libc and the
+// wide kernels of memcpy() and check_poison() instead.
+// The ranges checked are those of check_poison() on the bytes used, but
+// the probe for redzones cut by the end is left out when the terminator
+// is under it: a 0x00 byte never makes vaddss underflow.
+
+static inline int crosses_page(const void* p)
 {
-    if(process){
-        // ASan code
-        unsigned char c1, c2;
-        size_t i;
-        for (i = 0;; i++) {
-            c1 = (unsigned char)s1[i];
-            c2 = (unsigned char)s2[i];
-            if (c1 != c2 || c1 == '\0') break;
+    return ((uintptr_t)p & 4095) > 4096 - 16;
+}
+
+static inline uint32_t mask16(__m128i v, __m128i c)
+{
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, c));
+}
+
+// Chunk ending at `end` with some 0x8b (bitmap m), or right after one
+// ending with 0x8b: the windows of [lo, end). Returns the next carry.
+static uint32_t __attribute__((noinline)) check_runs(const uint8_t* lo, const uint8_t* end, uint32_t m, uint32_t carry)
+{
+    uint64_t c = carry;
+    if(runs_of_four(m, &c) != 0) check_poison_scan((uint8_t*)lo, (uint8_t*)end);
+    return m >> 13;
+}
+
+// check_blocks() for a chunk of 16 bytes
+static inline uint32_t check_chunk(const uint8_t* src, uint8_t* dest, size_t off,
+                                   uint32_t ms, uint32_t md, uint32_t carry)
+{
+    size_t lo = off != 0 ? off - 3 : 0;
+    uint32_t cs = (ms | (carry & 7)) != 0 ? check_runs(src + lo, src + off + 16, ms, carry & 7) : 0;
+    uint32_t cd = (md | carry >> 3) != 0 ? check_runs(dest + lo, dest + off + 16, md, carry >> 3) : 0;
+    return cs | cd << 3;
+}
+
+// Last chunk: the windows among the first `len` bytes at base + off
+// (bitmap m), and if `probe` the redzones cut by their end
+static inline void check_last(const uint8_t* base, size_t off, uint32_t m, uint32_t carry, size_t len, int probe)
+{
+    m &= (1U << len) - 1;
+    if((m | carry) != 0) check_runs(base + (off != 0 ? off - 3 : 0), base + off + len, m, carry);
+    if(probe && off + len != 0) fpadd_magic((uint8_t*)base + off + len - 1);
+}
+
+// the rest of a long string from q, at most max bytes from p
+static size_t __attribute__((noinline)) strnlen_long(uint8_t* p, uint8_t* q, size_t max)
+{
+    size_t len = q - p + strnlen((char*)q, max - (q - p));
+    check_poison(q - 3, p + len - q + 3);
+    return len;
+}
+
+// strnlen(), checking [s, s + length) (aligned loads never leave the page)
+static size_t strnlen_checked(const char* s, size_t max)
+{
+    const __m128i rz = _mm_set1_epi8((char)FLOAT_MAGIC_POISON_BYTE);
+    const __m128i zero = _mm_setzero_si128();
+    uint8_t* p = (uint8_t*)s;
+    uint8_t* b = (uint8_t*)((uintptr_t)p & ~(uintptr_t)15);
+    uint32_t head = ~0U << (p - b);
+    uint32_t carry = 0;
+
+    for(;; b += 16, head = ~0U){
+        __m128i v = _mm_load_si128((__m128i*)b);
+        uint32_t z = mask16(v, zero) & head;
+        uint32_t m = mask16(v, rz) & head;
+        size_t end = z != 0 ? (size_t)__builtin_ctz(z) : 16;
+        // b - p wraps around in the first chunk, end does not
+        if((size_t)(b - p) + end > max) end = p + max - b;
+        if(end < 16) m &= (1U << end) - 1;
+        if((m | carry) != 0) carry = check_runs(b - 3 < p ? p : b - 3, b + end, m, carry);
+        if(end < 16){
+            if(b + end != p && (z & (1U << end)) == 0) fpadd_magic(b + end - 1);
+            return b + end - p;
+        }
+        if(b + 16 - p >= CHECK_SCAN_BYTES) return strnlen_long(p, b + 16, max);
+    }
+}
+
+// strncmp(), checking both strings up to the first difference or
+// terminator, that one included when `inclusive`
+static int strncmp_checked(const char* s1, const char* s2, size_t n, int inclusive)
+{
+    const __m128i rz = _mm_set1_epi8((char)FLOAT_MAGIC_POISON_BYTE);
+    const __m128i zero = _mm_setzero_si128();
+    const uint8_t* a = (const uint8_t*)s1;
+    const uint8_t* b = (const uint8_t*)s2;
+    uint32_t carry = 0;
+    size_t off;
+
+    if(n == 0) return 0;
+    for(off = 0;; off += 16){
+        size_t rest = n - off < 16 ? n - off : 16;
+        if(crosses_page(a + off) || crosses_page(b + off)){
+            size_t i = 0;
+            while(i < rest && a[off + i] == b[off + i] && a[off + i] != 0) i++;
+            if(i < 16) break;
+        }
+        __m128i va = _mm_loadu_si128((__m128i*)(a + off));
+        __m128i vb = _mm_loadu_si128((__m128i*)(b + off));
+        uint32_t stop = (mask16(va, vb) ^ 0xffff) | mask16(va, zero);
+        if(rest < 16) stop |= ~0U << rest;
+        if(stop != 0){
+            size_t i = __builtin_ctz(stop);
+            size_t len = inclusive && i < rest ? i + 1 : i;
+            if(i == rest){
+                check_last(a, off, mask16(va, rz), carry, len, 1);
+                check_last(b, off, mask16(vb, rz), carry, len, 1);
+                return 0;
+            }
+            check_last(a, off, mask16(va, rz), carry, len, a[off + i] != 0);
+            check_last(b, off, mask16(vb, rz), carry, len, b[off + i] != 0);
+            return (int)a[off + i] - (int)b[off + i];
+        }
+        // same bytes in both strings
+        uint32_t m = mask16(va, rz);
+        if((m | carry) != 0){
+            check_runs(b + (off != 0 ? off - 3 : 0), b + off + 16, m, carry);
+            carry = check_runs(a + (off != 0 ? off - 3 : 0), a + off + 16, m, carry);
+        }
+    }
+
+    // a page boundary in the last chunk
+    size_t i = off;
+    while(i < n && a[i] == b[i] && a[i] != 0) i++;
+    size_t len = inclusive && i < n ? i + 1 : i;
+    size_t lo = off != 0 ? off - 3 : 0;
+    if(len > lo){
+        check_poison((void*)(a + lo), len - lo);
+        check_poison((void*)(b + lo), len - lo);
+    }
+    return i < n ? (int)a[i] - (int)b[i] : 0;
+}
+
+// the rest of a long string from the chunk at off, not stored yet
+static size_t __attribute__((noinline)) copy_string_long(uint8_t* d, const uint8_t* s, size_t off, size_t n)
+{
+    size_t k = off + 16 + strnlen((const char*)s + off + 16, n - off - 16);
+    floatzone_memcpy(d + off, s + off, (k < n ? k + 1 : k) - off);
+    return k;
+}
+
+// Copy src, terminator included, but at most n bytes, checking both
+// buffers; returns strnlen(src, n). Like copy_checked_sse2(), a chunk is
+// only stored once the next one has been checked.
+static size_t __attribute__((noinline)) copy_string_loop(uint8_t* d, const uint8_t* s, size_t n)
+{
+    const __m128i rz = _mm_set1_epi8((char)FLOAT_MAGIC_POISON_BYTE);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i prev = zero;
+    uint32_t carry = 0;
+    size_t off, k;
+
+    for(off = 0;; off += 16){
+        size_t rest = n - off < 16 ? n - off : 16;
+        if(crosses_page(s + off) && strnlen((const char*)s + off, rest) < 16) break;
+        __m128i v = _mm_loadu_si128((__m128i*)(s + off));
+        uint32_t stop = mask16(v, zero);
+        if(rest < 16) stop |= ~0U << rest;
+        if(stop != 0){
+            k = __builtin_ctz(stop);
+            size_t copy = k < rest ? k + 1 : k;
+            check_last(s, off, mask16(v, rz), carry & 7, copy, k == rest);
+            // probes: a 16-byte load would often miss the store forwarding
+            // of a previous write of the same short string
+            if(off + copy != 0){
+                size_t lo = off != 0 ? off - 3 : 0;
+                check_poison(d + lo, off + copy - lo);
+            }
+            if(off != 0) _mm_storeu_si128((__m128i*)(d + off - 16), prev);
+            memcpy(d + off, s + off, copy);
+            return off + k;
         }
-        if(i != 0){
-            check_poison((void*)s1, i);
-            check_poison((void*)s2, i);
+        uint32_t ms = mask16(v, rz);
+        uint32_t md = mask16(_mm_loadu_si128((__m128i*)(d + off)), rz);
+        if((ms | md | carry) != 0) carry = check_chunk(s, d, off, ms, md, carry);
+        if(off != 0) _mm_storeu_si128((__m128i*)(d + off - 16), prev);
+        prev = v;
+        if(off + 16 >= CHECK_SCAN_BYTES) return copy_string_long(d, s, off, n);
+    }
+
+    // a page boundary in the last chunk
+    size_t rest = n - off < 16 ? n - off : 16;
+    k = strnlen((const char*)s + off, rest);
+    size_t copy = k < rest ? k + 1 : k;
+    size_t lo = off != 0 ? off - 3 : 0;
+    if(off + copy > lo){
+        check_poison((void*)(s + lo), off + copy - lo);
+        check_poison(d + lo, off + copy - lo);
+    }
+    if(off != 0) _mm_storeu_si128((__m128i*)(d + off - 16), prev);
+    memcpy(d + off, s + off, copy);
+    return off + k;
+}
+
+// copy_string_loop(), with the string ending in the first chunk inline
+static inline size_t copy_string_checked(char* dest, const char* src, size_t n)
+{
+    uint8_t* d = (uint8_t*)dest;
+    const uint8_t* s = (const uint8_t*)src;
+    if(n > 16 && !crosses_page(s)){
+        __m128i v = _mm_loadu_si128((__m128i*)s);
+        uint32_t z = mask16(v, _mm_setzero_si128());
+        if(z != 0){
+            size_t k = __builtin_ctz(z);
+            uint32_t m = mask16(v, _mm_set1_epi8((char)FLOAT_MAGIC_POISON_BYTE)) & ((2U << k) - 1);
+            if(m != 0) check_runs(s, s + k + 1, m, 0);
+            check_poison(d, k + 1);
+            memcpy(d, s, k + 1);
+            return k;
         }
     }
+    return copy_string_loop(d, s, n);
+}
+
+int __attribute__((disable_sanitizer_instrumentation)) floatzone_strcmp(const char *s1, const char *s2)
+{
+    if(process){
+        return strncmp_checked(s1, s2, SIZE_MAX, 0);
+    }
     return strcmp(s1, s2);
 }
 
 int __attribute__((disable_sanitizer_instrumentation)) floatzone_strncmp(const char *s1, const char *s2, size_t n)
 {
     if(process){
-        // ASan code
-        unsigned char c1, c2;
-        size_t i;
-        for (i = 0; i < n; i++) {
-            c1 = (unsigned char)s1[i];
-            c2 = (unsigned char)s2[i];
-            if (c1 != c2 || c1 == '\0') break;
-        }
-        size_t min = n;
-        if(i+1 < n) min = i+1;
-        if(n != 0){
-            check_poison((void*)s1, min);
-            check_poison((void*)s2, min);
-        }
+        return strncmp_checked(s1, s2, n, 1);
     }
     return strncmp(s1, s2, n);
 }
@@ -543,11 +2846,7 @@ int __attribute__((disable_sanitizer_instrumentation)) floatzone_memcmp(const vo
 size_t __attribute__((disable_sanitizer_instrumentation)) floatzone_strlen(const char *s)
 {
     if(process){
-        size_t size = strlen(s);
-        if(size != 0){
-            check_poison((void*)s, size);
-        }
-        return size;
+        return strnlen_checked(s, SIZE_MAX);
     }
     return strlen(s);
 }
@@ -555,10 +2854,7 @@ size_t __attribute__((disable_sanitizer_instrumentation)) floatzone_strlen(const
 size_t __attribute__((disable_sanitizer_instrumentation)) floatzone_strnlen(const char *s, size_t maxlen)
 {
     if(process){
-        if(maxlen != 0){
-            check_poison((void*)s, maxlen);
-        }
-        return strnlen(s, maxlen);
+        return strnlen_checked(s, maxlen);
     }
     return strnlen(s, maxlen);
 }
@@ -566,14 +2862,15 @@ size_t __attribute__((disable_sanitizer_instrumentation)) floatzone_strnlen(cons
 char* __attribute__((disable_sanitizer_instrumentation)) floatzone_strcpy(char* dest, const char* src)
 {
     if(process){
-        return floatzone_memcpy(dest, src, strlen(src) + 1);
+        copy_string_checked(dest, src, SIZE_MAX);
+        return dest;
     }
     return strcpy(dest, src);
 }
 
 char* __attribute__((disable_sanitizer_instrumentation)) floatzone_strcat(char *restrict dest, const char *restrict src) {
     if(process){
-        floatzone_memcpy(dest + strlen(dest), src, strlen(src) + 1);
+        copy_string_checked(dest + strlen(dest), src, SIZE_MAX);
         return dest;
     }
     return strcat(dest, src);
@@ -581,23 +2878,25 @@ char* __attribute__((disable_sanitizer_instrumentation)) floatzone_strcat(char *
 
 char* __attribute__((disable_sanitizer_instrumentation)) floatzone_strncat(char *restrict dest, const char *restrict src, size_t n) {
     if(process){
-        char *s = dest;
-        dest += strlen(dest);
-        size_t ss = strnlen(src, n);
-        dest[ss] = '\0';
-        floatzone_memcpy(dest, src, ss);
-        return s;
+        char *d = dest + strlen(dest);
+        if(copy_string_checked(d, src, n) == n){
+            // no terminator among the first n bytes of src
+            fpadd_magic(d + n);
+            d[n] = '\0';
+        }
+        return dest;
     }
     return strncat(dest, src, n);
 }
 
 char* __attribute__((disable_sanitizer_instrumentation)) floatzone_strncpy(char *restrict dest, const char *restrict src, size_t n) {
     if(process){
-        size_t size = strnlen(src, n);
-        if(size != n){
-            floatzone_memset(dest + size, '\0', n - size);
+        size_t size = copy_string_checked(dest, src, n);
+        // the terminator is copied already
+        if(size + 1 < n){
+            floatzone_memset(dest + size + 1, '\0', n - size - 1);
         }
-        return floatzone_memcpy(dest, src, size);
+        return dest;
     }
     return strncpy(dest, src, n);
 }
@@ -721,33 +3020,190 @@ const int regs_map[16] = {
     /* R15 = 15 */[R15] = REG_R15
 };
 
-//Row: mod
-//Column rm
-//Element: reg, SIB, offset size
-#define     NOTSUPP    {-1U, -1U, -1U}
-const uint32_t lut_modrm[4][16][3] =
+#define MAX_INSN_BYTES 15
+
+// One FP instruction (SSE, AVX, AVX-512, FMA or x87), see decode_fp()
+typedef struct {
+    int len;
+    int vex;        // 0: legacy, 1: VEX, 2: EVEX
+    int map;        // 0: one-byte opcode (x87), 1: 0f, 2: 0f38, 3: 0f3a
+    int opc, pp, w, l;
+    int mod, reg, rm, vvvv;
+    int rel;        // offset of the disp32 if RIP-relative, 0 if not
+    uint8_t *addr;  // memory operand if mod != 3, NULL if unknown
+} FpInsn;
+
+// Opcodes of the 0f map with a mod/rm byte (the SSE ones) and the ones
+// with an imm8 on top; maps 0f38 and 0f3a always have mod/rm
+static inline int map1_modrm(int opc)
+{
+    return (opc >= 0x10 && opc <= 0x17) || (opc >= 0x28 && opc <= 0x2f) ||
+           (opc >= 0x50 && opc <= 0x7f && opc != 0x77) ||
+           (opc >= 0xc2 && opc <= 0xc6) || opc >= 0xd0;
+}
+
+static inline int map1_imm8(int opc)
+{
+    return (opc >= 0x70 && opc <= 0x73) || opc == 0xc2 || (opc >= 0xc4 && opc <= 0xc6);
+}
+
+// sqrt, add, mul, sub, min, div, max
+static inline int map1_arith(int opc)
 {
-    {//Mod 00
-        {RAX, 0, 0}, {RCX, 0, 0}, {RDX, 0, 0}, {RBX, 0, 0}, {RSP, 1, 0}, NOTSUPP,    {RSI, 0, 0}, {RDI, 0, 0}, {R8, 0, 0}, {R9, 0, 0}, {R10, 0, 0}, {R11, 0, 0}, {R12, 1, 0}, NOTSUPP,   {R14, 0, 0}, {R15, 0, 0},
-    },
+    return opc == 0x51 || opc == 0x58 || opc == 0x59 || (opc >= 0x5c && opc <= 0x5f);
+}
 
-    {//Mod 01
-        {RAX, 0, 1}, {RCX, 0, 1}, {RDX, 0, 1}, {RBX, 0, 1}, {RSP, 1, 1}, {RBP, 0, 1}, {RSI, 0, 1}, {RDI, 0, 1}, {R8, 0, 1}, {R9, 0, 1}, {R10, 0, 1}, {R11, 0, 1}, {R12, 1, 1}, {R13, 0, 1}, {R14, 0, 1}, {R15, 0, 1},
-    },
+/*  decode_fp: decode the FP instruction at op, without libxed.
+    e.g. vaddss xmm0, xmm1, [rip+0x1234] -> len 8, addr next RIP+0x1234
+Arguments:
+- op:       input,  pointer to start of the instruction
+- uc:       input,  regs saved during exception, NULL for the length only
+- in:       output, the decoded instruction
+Return:
+- Length of the instruction
+- 0 if it is not an FP instruction we know
+ */
+static int decode_fp(uint8_t *op, ucontext_t *uc, FpInsn *in)
+{
+    uint8_t *p = op;
+    int opsize = 0, rep = 0, seg = 0, addr32 = 0, bcast = 0;
+    int rex_r = 0, rex_x = 0, rex_b = 0, rex_r2 = 0;
+    int modrm, base = RNONE, index = RNONE, scale = 0, disp_size, disp_n = 1, rip = 0;
+    int32_t disp = 0;
+
+    memset(in, 0, sizeof(*in));
+
+    //Prefixes: the last of f2/f3 wins over 66
+    for(;; p++) {
+        if(p - op >= 4) return 0;
+        if(*p == 0x66) opsize = 1;
+        else if(*p == 0xf3) rep = 2;
+        else if(*p == 0xf2) rep = 3;
+        else if(*p == 0x64 || *p == 0x65) seg = 1;
+        else if(*p == 0x67) addr32 = 1;
+        else if(*p != 0x26 && *p != 0x2e && *p != 0x36 && *p != 0x3e) break;
+    }
+    in->pp = rep ? rep : opsize;
+    in->map = 1;
+
+    if(*p == 0x62) {
+        // EVEX: R X B R' 0 m m m, W vvvv 1 pp, z L'L b V' aaa; inverted bits
+        if(opsize || rep) return 0;
+        in->vex = 2;
+        rex_r  = 1^(p[1]>>7);
+        rex_x  = 1^((p[1]>>6)&1);
+        rex_b  = 1^((p[1]>>5)&1);
+        rex_r2 = 1^((p[1]>>4)&1);
+        in->map = p[1] & 7;
+        in->w = p[2] >> 7;
+        in->vvvv = (0xf ^ ((p[2]>>3)&0xf)) | ((1^((p[3]>>3)&1)) << 4);
+        in->pp = p[2] & 3;
+        in->l = (p[3]>>5) & 3;
+        bcast = (p[3]>>4) & 1;
+        p += 4;
+    }
+    else if(*p == 0xc5 || *p == 0xc4) {
+        if(opsize || rep) return 0;
+        in->vex = 1;
+        rex_r = 1^(p[1]>>7);
+        if(*p == 0xc4) {
+            rex_x = 1^((p[1]>>6)&1);
+            rex_b = 1^((p[1]>>5)&1);
+            in->map = p[1] & 0x1f;
+            in->w = p[2] >> 7;
+            p++;
+        }
+        // W vvvv L pp, vvvv inverted
+        in->vvvv = 0xf ^ ((p[1]>>3)&0xf);
+        in->l = (p[1]>>2) & 1;
+        in->pp = p[1] & 3;
+        p += 2;
+    }
+    else {
+        if((*p & 0xf0) == 0x40) {
+            rex_r = (*p>>2)&1;
+            rex_x = (*p>>1)&1;
+            rex_b = *p&1;
+            in->w = (*p>>3)&1;
+            p++;
+        }
+        if(*p >= 0xd8 && *p <= 0xdf) in->map = 0;
+        else {
+            if(*p++ != 0x0f) return 0;
+            if(*p == 0x38) in->map = 2;
+            if(*p == 0x3a) in->map = 3;
+            if(in->map != 1) p++;
+        }
+    }
+    if(in->map < 0 || in->map > 3) return 0;
+    if(in->map == 0 && in->vex) return 0;
 
-    {//Mod 10
-        {RAX, 0, 4}, {RCX, 0, 4}, {RDX, 0, 4}, {RBX, 0, 4}, {RSP, 1, 4}, {RBP, 0, 4}, {RSI, 0, 4}, {RDI, 0, 4}, {R8, 0, 4}, {R9, 0, 4}, {R10, 0, 4}, {R11, 0, 4}, {R12, 1, 4}, {R13, 0, 4}, {R14, 0, 4}, {R15, 0, 4},
-    },
+    in->opc = *p++;
+    if(in->map == 1 && !map1_modrm(in->opc)) return 0;
 
-    {//Mod 11
-        NOTSUPP,    NOTSUPP,    NOTSUPP,    NOTSUPP,    NOTSUPP,    NOTSUPP,    NOTSUPP,    NOTSUPP,     NOTSUPP,    NOTSUPP,    NOTSUPP,    NOTSUPP,    NOTSUPP,    NOTSUPP,    NOTSUPP,    NOTSUPP,
-    },
-};
+    //mod/rm decode
+    modrm = *p++;
+    in->mod = modrm >> 6;
+    in->reg = (rex_r2<<4) | (rex_r<<3) | ((modrm>>3)&7);
+    in->rm  = (rex_b<<3) | (modrm&7);
+    if(in->mod == 3) {
+        if(in->vex == 2) in->rm |= rex_x << 4;
+    }
+    else {
+        base = in->rm;
+        disp_size = in->mod == 1 ? 1 : in->mod == 2 ? 4 : 0;
+        if((modrm&7) == 4) {
+            int sib = *p++;
+            index = (rex_x<<3) | ((sib>>3)&7);
+            if(index == RSP) index = RNONE;
+            scale = sib >> 6;
+            base = (rex_b<<3) | (sib&7);
+            //cursed SIB encoding: no base, disp32
+            if((sib&7) == 5 && in->mod == 0) {
+                base = RNONE;
+                disp_size = 4;
+            }
+        }
+        else if((modrm&7) == 5 && in->mod == 0) {
+            base = RNONE;
+            rip = 1;
+            disp_size = 4;
+        }
+        if(rip) in->rel = p - op;
+        if(disp_size == 1) disp = (int8_t)*p;
+        if(disp_size == 4) memcpy(&disp, p, 4);
+        p += disp_size;
+
+        // EVEX disp8 is scaled by the memory operand size (disp8*N), which
+        // depends on the instruction: known for the arithmetic ones only
+        if(in->vex == 2 && disp_size == 1) {
+            int elem = in->pp & 1 ? 8 : 4;
+            if(in->map == 1 && map1_arith(in->opc))
+                disp_n = in->pp >= 2 || bcast ? elem : 16 << in->l;
+            else disp_n = 0;
+        }
+    }
 
-const int scales[4] = {1,2,4,8};
+    if(in->map == 3 || (in->map == 1 && map1_imm8(in->opc))) p++;
+    in->len = p - op;
+    if(in->len > MAX_INSN_BYTES) return 0;
+
+    if(uc != NULL && in->mod != 3 && disp_n != 0 && !seg) {
+        uint64_t ea = (int64_t)disp * disp_n;
+        if(base != RNONE) ea += uc->uc_mcontext.gregs[regs_map[base]];
+        if(index != RNONE) ea += uc->uc_mcontext.gregs[regs_map[index]] << scale;
+        // relative to the next instruction
+        if(rip) ea += (uint64_t)op + in->len;
+        if(addr32) ea &= 0xffffffff;
+        in->addr = (uint8_t *) ea;
+    }
+    return in->len;
+}
 
 /*  get_fault_addr: decode FP instruction and return faulting memory address.
     e.g. vadds xmm0, xmm1, [rax+rbx*4+1234] -> rax+rbx*4+1234
+    The checks are (v)addss with a memory operand, in any encoding (legacy
+    SSE, VEX or EVEX) and any addressing (RIP-relative and disp32 too).
 Arguments:
 - op:       input,  pointer to start of faulting FP instruction
 - op_len:   output, pointer to return the length of the opcode
@@ -755,96 +3211,17 @@ Arguments:
 Return:
 - Pointer to fualting address
 - NULL in case of error, (op_len is set to 0)
-
-Note: When I wrote this code only God and I understood what it did,
-Now only God knows.
  */
 void* get_fault_addr(uint8_t *op, int *op_len, ucontext_t *uc)
 {
-    uint32_t rex_x, rex_r, rex_b, modrm, mod, reg, rm, scale, index, base, sib, pos;
-    int32_t offset;
-    uint8_t *ptr;
-
-    //Verify VEX instruction
-    if (op[0] != 0xc5 && op[0] != 0xc4) goto get_fault_addr_error;
+    FpInsn in;
 
-    base  = 0;
-    index = 0;
-    scale = 0;
-    offset = 0;
-
-    // vex 2 bytes
-    if (op[0] == 0xc5) {
-        if(op[2] != 0x58) goto get_fault_addr_error;
-        rex_r = 1^((op[1]>>7)&1);
-        rex_x = 0;
-        rex_b = 0;
-        pos = 3;    //point to modrm
-    }
-
-    // rex 3 bytes
-    if (op[0] == 0xc4) {
-        if(op[3] != 0x58) goto get_fault_addr_error;
-        rex_r = 1^((op[1]>>7)&1);
-        rex_x = 1^((op[1]>>6)&1);
-        rex_b = 1^((op[1]>>5)&1);
-        pos = 4;    //point to modrm
-    }
-
-    //mod/rm decode
-    modrm = op[pos];
-    mod = (modrm>>6)&0x3;
-    reg = (rex_r<<3) | ((modrm>>3)&0x7);
-    rm  = (rex_b<<3) | (modrm&0x7);
-    base = rm;
-    pos++;
-
-    //Check for supported mod/rm
-    if (lut_modrm[mod][rm][0] == -1U) goto get_fault_addr_error;
-
-    //If SIB
-    if(lut_modrm[mod][rm][1]) {
-        sib = op[pos];
-        scale = scales[(sib>>6) & 0x3];
-        index = (rex_x<<3) | ((sib>>3)&0x7);
-        base  = (rex_b<<3) | ((sib>>0)&0x7);
-        //cursed SIB encoding
-        if(mod != 0){
-            if (index == RSP) index = RNONE;
-        } else {
-            if((index == RSP) && (base == RBP || base == R13)) goto get_fault_addr_error;
-            if (index == RSP) index = RNONE;
-            if (base == RBP || base == R13) {
-                base = RNONE;
-            }
-        }
-        pos++;
-    }
-
-    //Offset
-    if(lut_modrm[mod][rm][2] == 1) {
-        offset = (int8_t)op[pos];
-        pos++;
+    if(decode_fp(op, uc, &in) == 0 || in.map != 1 || in.opc != 0x58 || in.addr == NULL) {
+        *op_len = 0;
+        return NULL;
     }
-    if(lut_modrm[mod][rm][2] == 4) {
-        offset = (int32_t)(((op[pos+0]&0xff) << 0) |
-                ((op[pos+1]&0xff) << 8) |
-                ((op[pos+2]&0xff) << 16) |
-                ((op[pos+3]&0xff) << 24));
-        pos += 4;
-    }
-
-get_fault_addr_success:
-    ptr = NULL;
-    *op_len = pos;
-    if (base != RNONE) ptr += uc->uc_mcontext.gregs[regs_map[base]];
-    if (index != RNONE) ptr += uc->uc_mcontext.gregs[regs_map[index]]*scale;
-    ptr += offset;
-    return (void *) ptr;
-
-get_fault_addr_error:
-    *op_len = 0;
-    return NULL;
+    *op_len = in.len;
+    return (void *) in.addr;
 }
 
 void dump(ucontext_t* uc) {
@@ -927,90 +3304,241 @@ const uint8_t epilog[] = {
     0x41, 0x59, 0x41, 0x58, 0x5d, 0x5e, 0x5f, 0x5a, 0x59, 0x5b, 0x58, 0xc3
 };
 
+// Re-execution stubs, cached by faulting RIP: FP-heavy code underflows on
+// the same few instructions over and over. A slot keeps the bytes of the
+// instruction its stub was built for (code can be unloaded and replaced),
+// and a hit only patches the register values into the stub. Each thread
+// has a cache of its own, so threads trap in parallel without locking.
+#define STUB_SLOTS 256
+#define STUB_SIZE 256 // prolog, instruction and epilog
+
+typedef struct {
+    uint8_t *rip;
+    int len;
+    uint8_t text[MAX_INSN_BYTES];
+} StubSlot;
+
+// The stubs are written through one view of a memfd and run from another,
+// so no page is writable and executable at once
+typedef struct {
+    uint8_t *rw, *rx;
+    StubSlot slots[STUB_SLOTS];
+} StubCache;
+
+static __thread StubCache *stub_cache __attribute__((tls_model("initial-exec")));
+
+// Frees the caches at thread exit. pthread_setspecific() is not
+// async-signal-safe in general, but glibc keeps the values of the first 32
+// keys (PTHREAD_KEY_2NDLEVEL_SIZE) in the thread descriptor itself and only
+// stores into it; beyond those it may calloc(). The key is made at startup,
+// so it is one of the first; if not, the handler does not use it and a
+// thread's cache outlives the thread.
+#define STUB_KEY_FIRST_BLOCK 32
+static pthread_key_t stub_key;
+static int stub_key_safe;
+
+// 0 if there is no memory for the views (left MAP_FAILED)
+static int stubs_map(StubCache *c)
+{
+    size_t size = STUB_SLOTS*STUB_SIZE;
+    int fd = memfd_create("floatzone-stubs", MFD_CLOEXEC);
+    c->rw = c->rx = MAP_FAILED;
+    if(fd >= 0 && ftruncate(fd, size) == 0) {
+        c->rw = (uint8_t *) mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+        c->rx = (uint8_t *) mmap(NULL, size, PROT_READ|PROT_EXEC, MAP_SHARED, fd, 0);
+    }
+    if(fd >= 0) close(fd);
+    if(c->rw == MAP_FAILED || c->rx == MAP_FAILED) {
+        if(c->rw != MAP_FAILED) munmap(c->rw, size);
+        if(c->rx != MAP_FAILED) munmap(c->rx, size);
+        // no memfd (old kernel): a single RWX mapping, as it used to be
+        c->rw = c->rx = (uint8_t *) mmap(NULL, size, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+    }
+    return c->rw != MAP_FAILED;
+}
+
+// made on the thread's first trap that needs a stub (mmap() is safe in a
+// signal handler, malloc() is not), and the views mapped again if that
+// failed or after a fork. NULL if there is no memory for them.
+static StubCache* stubs_get()
+{
+    StubCache *c = stub_cache;
+    if(c == NULL) {
+        c = (StubCache *) mmap(NULL, sizeof(StubCache), PROT_READ|PROT_WRITE, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+        if(c == MAP_FAILED) return NULL;
+        c->rw = c->rx = MAP_FAILED;
+        stub_cache = c;
+        if(stub_key_safe) pthread_setspecific(stub_key, c);
+    }
+    if(c->rw == MAP_FAILED && !stubs_map(c)) return NULL;
+    return c;
+}
+
+#if ENABLE_EXCEPTIONS == 1
+static void stubs_unmap(StubCache *c)
+{
+    if(c->rx != MAP_FAILED) munmap(c->rx, STUB_SLOTS*STUB_SIZE);
+    if(c->rw != c->rx) munmap(c->rw, STUB_SLOTS*STUB_SIZE);
+    c->rw = c->rx = MAP_FAILED;
+}
+
+// thread exit
+static void stubs_release(void *p)
+{
+    StubCache *c = (StubCache *) p;
+    stub_cache = NULL;
+    stubs_unmap(c);
+    munmap(c, sizeof(StubCache));
+}
+
+// a child shares the memfd with its parent: give it stubs of its own, on
+// its next trap
+static void stubs_atfork_child()
+{
+    StubCache *c = stub_cache;
+    if(c != NULL) {
+        stubs_unmap(c);
+        memset(c->slots, 0, sizeof(c->slots));
+    }
+}
+#endif
+
+static inline StubSlot* stub_slot(StubCache *c, uint8_t *op)
+{
+    return &c->slots[(((uintptr_t)op * 0x9e3779b97f4a7c15ULL) >> 32) % STUB_SLOTS];
+}
+
+#ifdef LIBXED_SO
+// libxed, loaded at startup (see handler_init()); NULL if it could not be,
+// which only matters once decode_fp() does not know an instruction
+static void (*xed_decoded_inst_zero_set_mode)(xed_decoded_inst_t* p, const xed_state_t* dstate);
+static xed_error_enum_t (*xed_decode)(xed_decoded_inst_t* xedd, const xed_uint8_t* itext, const unsigned int bytes);
+static xed_reg_enum_t (*xed_decoded_inst_get_base_reg)(const xed_decoded_inst_t* p, unsigned int mem_idx);
+
+#if ENABLE_EXCEPTIONS == 1
+static void xed_init()
+{
+    void (*xed_tables_init)(void);
+    void *handle = dlopen(LIBXED_SO, RTLD_LAZY);
+    if(!handle) return;
+    dlerror();
+    xed_tables_init = dlsym(handle, "xed_tables_init");
+    if(dlerror() != NULL) exit(-37);
+    xed_decoded_inst_zero_set_mode = dlsym(handle, "xed_decoded_inst_zero_set_mode");
+    if(dlerror() != NULL) exit(-37);
+    xed_decode = dlsym(handle, "xed_decode");
+    if(dlerror() != NULL) exit(-37);
+    xed_decoded_inst_get_base_reg = dlsym(handle, "xed_decoded_inst_get_base_reg");
+    if(dlerror() != NULL) exit(-37);
+
+    xed_tables_init();
+}
+#endif
+
+// *rip: set if the memory operand is RIP-relative
+static int xed_insn_len(uint8_t *op, int *rip)
+{
+    xed_state_t dstate;
+    xed_decoded_inst_t xedd;
+
+    if(xed_decode == NULL) {
+        printf("Can't open libxed.so\n");
+        exit(-1);
+    }
+    dstate.mmode=XED_MACHINE_MODE_LONG_64;
+    xed_decoded_inst_zero_set_mode(&xedd, &dstate);
+    xed_decode(&xedd, op, XED_MAX_INSTRUCTION_BYTES);
+    *rip = xed_decoded_inst_get_base_reg(&xedd, 0) == XED_REG_RIP;
+    return xed_decoded_inst_get_length(&xedd);
+}
+#else
+
+static int xed_insn_len(uint8_t *op, int *rip)
+{
+    (void)rip;
+    fprintf(stderr, "[FLOATZONE] Unknown FP instruction at %p (built without libxed)\n", op);
+    exit(-1);
+}
+#endif
+
 /*
 This is a terrible piece of code, but there are no other way around (I guess).
 This code disassemble the instruction present at `op` and returns its opcode
-length. This is needed since we need to skip the faulting SIGFPE instruction.
+length (decode_fp() knows the common FP ones, libxed the rest). This is needed since we need to skip the faulting SIGFPE instruction.
 To ensure we do not affect original execution, we re-execute the faulting
 instruction in an environment without FTZ enabled. This achieved with a
-terrible trick of doing some sort of JIT'ing.
+terrible trick of doing some sort of JIT'ing. Decoding and building the stub
+only happen the first time an instruction traps on a thread, see StubCache.
 */
+static void __attribute__((noreturn)) cannot_re_execute(uint8_t *op, const char *why)
+{
+    fprintf(stderr, "[FLOATZONE] Cannot re-execute the instruction at %p: %s\n", op, why);
+    exit(-1);
+}
+
 int get_ins_len_and_re_execute(uint8_t *op, ucontext_t *uc) {
-    static uint8_t *rwx;
-    static int first_time = 1;
-    xed_state_t dstate;
-    xed_decoded_inst_t xedd;
-    const xed_inst_t* xi;
-    int noperands;
-    const xed_operand_t* operand;
-    xed_operand_enum_t opname;
-    xed_reg_enum_t reg;
-    int op_len;
+    FpInsn in;
+    int op_len, rip = 0;
     void (*fptr)(void);
-
-    static void (*xed_tables_init)(void);
-    static void (*xed_decoded_inst_zero_set_mode)(xed_decoded_inst_t* p, const xed_state_t* dstate);
-    static xed_error_enum_t (*xed_decode)(xed_decoded_inst_t* xedd, const xed_uint8_t* itext, const unsigned int bytes);
-    static const xed_operand_t* (*xed_inst_operand)(const xed_inst_t *p, unsigned int i);
-    static xed_reg_enum_t (*xed_decoded_inst_get_reg)(const xed_decoded_inst_t *p, xed_operand_enum_t reg_operand);
-    static xed_uint_t (*xed_operand_written)(const xed_operand_t *p);
-    void *handle;
-
-    if(first_time) {
-        handle = dlopen(LIBXED_SO, RTLD_LAZY);
-        if(!handle) {
-            printf("Can't open libxed.so\n");
-            exit(-1);
+    StubCache *c;
+    StubSlot *slot;
+    uint8_t *stub;
+
+    c = stubs_get();
+    if(c == NULL) cannot_re_execute(op, "no memory for its stub");
+    slot = stub_slot(c, op);
+    stub = c->rw + (slot - c->slots)*STUB_SIZE;
+    if(slot->rip != op || memcmp(slot->text, op, slot->len) != 0) {
+        //Get instruction length
+        op_len = decode_fp(op, NULL, &in);
+        if(op_len == 0) {
+            op_len = xed_insn_len(op, &rip);
+            // somewhere in there is a displacement the stub would have to fix
+            if(rip) cannot_re_execute(op, "RIP-relative operand");
+        }
+        // the stub only restores xmm0-15, not xmm16-31 nor the mask registers
+        if(in.vex == 2) cannot_re_execute(op, "EVEX encoded");
+
+        //Copy the assembly wrapper to re-execute the faulty instr
+        memcpy(stub, prolog, sizeof(prolog));
+        memcpy(stub+sizeof(prolog), op, op_len);
+        memcpy(stub+sizeof(prolog)+op_len, epilog, sizeof(epilog));
+
+        // RIP-relative: the stub runs elsewhere, so its displacement has to
+        // point at the same address from there
+        if(in.rel != 0) {
+            int32_t disp;
+            uint8_t *copy = c->rx + (slot - c->slots)*STUB_SIZE + sizeof(prolog);
+            memcpy(&disp, op + in.rel, 4);
+            int64_t moved = (int64_t)disp + (op - copy);
+            if(moved != (int32_t)moved) cannot_re_execute(op, "RIP-relative operand out of reach of its stub");
+            disp = (int32_t)moved;
+            memcpy(stub+sizeof(prolog)+in.rel, &disp, 4);
         }
-        dlerror();
-        xed_tables_init = dlsym(handle, "xed_tables_init");
-        if(dlerror() != NULL) exit(-37);
-        xed_decoded_inst_zero_set_mode = dlsym(handle, "xed_decoded_inst_zero_set_mode");
-        if(dlerror() != NULL) exit(-37);
-        xed_decode = dlsym(handle, "xed_decode");
-        if(dlerror() != NULL) exit(-37);
-        xed_inst_operand = dlsym(handle, "xed_inst_operand");
-        if(dlerror() != NULL) exit(-37);
-        xed_decoded_inst_get_reg = dlsym(handle, "xed_decoded_inst_get_reg");
-        if(dlerror() != NULL) exit(-37);
-        xed_operand_written = dlsym(handle, "xed_operand_written");
-        if(dlerror() != NULL) exit(-37);
-
-        xed_tables_init();
-        first_time = 0;
-        rwx = (uint8_t *) mmap(NULL, 0x1000, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
-    }
-
-    //Get instruction length
-    dstate.mmode=XED_MACHINE_MODE_LONG_64;
-    xed_decoded_inst_zero_set_mode(&xedd, &dstate);
-    xed_decode(&xedd, op, XED_MAX_INSTRUCTION_BYTES);
-    xi = xed_decoded_inst_inst(&xedd);
-    op_len = xed_decoded_inst_get_length(&xedd);
-
 
-    //Copy the assembly wrapper to re-execute the faulty instr
-    fptr = (void(*)(void))rwx;
-    memcpy(rwx, prolog, sizeof(prolog));
-    memcpy(rwx+sizeof(prolog), op, op_len);
-    memcpy(rwx+sizeof(prolog)+op_len, epilog, sizeof(epilog));
+        slot->rip = op;
+        slot->len = op_len;
+        memcpy(slot->text, op, op_len);
+    }
+    op_len = slot->len;
+    fptr = (void(*)(void))(c->rx + (slot - c->slots)*STUB_SIZE);
 
     //Patch the opcodes to restore the original registers
-    memcpy(&rwx[0x17+ 0+2] ,  &uc->uc_mcontext.gregs[REG_RAX], 8);
-    memcpy(&rwx[0x17+10+2] ,  &uc->uc_mcontext.gregs[REG_RBX], 8);
-    memcpy(&rwx[0x17+20+2] ,  &uc->uc_mcontext.gregs[REG_RCX], 8);
-    memcpy(&rwx[0x17+30+2] ,  &uc->uc_mcontext.gregs[REG_RDX], 8);
-    memcpy(&rwx[0x17+40+2] ,  &uc->uc_mcontext.gregs[REG_RDI], 8);
-    memcpy(&rwx[0x17+50+2] ,  &uc->uc_mcontext.gregs[REG_RSI], 8);
-    memcpy(&rwx[0x17+60+2] ,  &uc->uc_mcontext.gregs[REG_RBP], 8);
-    memcpy(&rwx[0x17+70+2] ,  &uc->uc_mcontext.gregs[REG_R8 ], 8);
-    memcpy(&rwx[0x17+80+2] ,  &uc->uc_mcontext.gregs[REG_R9 ], 8);
-    memcpy(&rwx[0x17+90+2] ,  &uc->uc_mcontext.gregs[REG_R10], 8);
-    memcpy(&rwx[0x17+100+2],  &uc->uc_mcontext.gregs[REG_R11], 8);
-    memcpy(&rwx[0x17+110+2],  &uc->uc_mcontext.gregs[REG_R12], 8);
-    memcpy(&rwx[0x17+120+2],  &uc->uc_mcontext.gregs[REG_R13], 8);
-    memcpy(&rwx[0x17+130+2],  &uc->uc_mcontext.gregs[REG_R14], 8);
-    memcpy(&rwx[0x17+140+2],  &uc->uc_mcontext.gregs[REG_R15], 8);
+    memcpy(&stub[0x17+ 0+2] ,  &uc->uc_mcontext.gregs[REG_RAX], 8);
+    memcpy(&stub[0x17+10+2] ,  &uc->uc_mcontext.gregs[REG_RBX], 8);
+    memcpy(&stub[0x17+20+2] ,  &uc->uc_mcontext.gregs[REG_RCX], 8);
+    memcpy(&stub[0x17+30+2] ,  &uc->uc_mcontext.gregs[REG_RDX], 8);
+    memcpy(&stub[0x17+40+2] ,  &uc->uc_mcontext.gregs[REG_RDI], 8);
+    memcpy(&stub[0x17+50+2] ,  &uc->uc_mcontext.gregs[REG_RSI], 8);
+    memcpy(&stub[0x17+60+2] ,  &uc->uc_mcontext.gregs[REG_RBP], 8);
+    memcpy(&stub[0x17+70+2] ,  &uc->uc_mcontext.gregs[REG_R8 ], 8);
+    memcpy(&stub[0x17+80+2] ,  &uc->uc_mcontext.gregs[REG_R9 ], 8);
+    memcpy(&stub[0x17+90+2] ,  &uc->uc_mcontext.gregs[REG_R10], 8);
+    memcpy(&stub[0x17+100+2],  &uc->uc_mcontext.gregs[REG_R11], 8);
+    memcpy(&stub[0x17+110+2],  &uc->uc_mcontext.gregs[REG_R12], 8);
+    memcpy(&stub[0x17+120+2],  &uc->uc_mcontext.gregs[REG_R13], 8);
+    memcpy(&stub[0x17+130+2],  &uc->uc_mcontext.gregs[REG_R14], 8);
+    memcpy(&stub[0x17+140+2],  &uc->uc_mcontext.gregs[REG_R15], 8);
     
     asm volatile("lfence"); //Avoid MC.SMC
 
@@ -1054,44 +3582,219 @@ int get_ins_len_and_re_execute(uint8_t *op, ucontext_t *uc) {
     return op_len;
 }
 
-void handler(int sig, siginfo_t* si, void* vcontext)
+/*
+Emulation of the FP arithmetic that underflows in the program: add, sub,
+mul and div of SSE and AVX (ss, sd, ps, pd) and the FMA3 family. The
+result is computed without FTZ, in the rounding mode of the program, and
+written straight into the saved registers, so these traps need neither
+the decoder nor a stub. Anything else (EVEX, other opcodes, segment or
+address-size prefixes) returns 0 and is left to get_ins_len_and_re_execute().
+*/
+
+// the XSAVE area of the signal frame: software-reserved bytes (the
+// kernel's struct _fpx_sw_bytes) and header
+#define XSTATE_SW_BYTES 464
+#define XSTATE_HEADER 512
+#define XSTATE_MAGIC1 0x46505853U
+#define XSTATE_YMM 2 // YMM_Hi128: upper halves of ymm0-15
+#define XSTATE_ZMM 6 // ZMM_Hi256: upper halves of zmm0-15
+
+#define FMA_OP 0x100 // fp_compute() ops past the opcodes of add/sub/mul/div
+#define FMA_NEG_ADD 1
+#define FMA_NEG_MUL 2
+
+typedef union {
+    float f[8];
+    double d[4];
+    uint8_t b[32];
+} FpVec;
+
+static uint32_t xstate_off[8]; // from CPUID leaf 0xd, see handler_init()
+
+// component c of the XSAVE area in the frame, NULL if it was not saved
+static uint8_t* xstate_comp(ucontext_t *uc, int c, size_t size)
 {
-    int op_len;
-    ucontext_t *uc = (ucontext_t *)vcontext;
-    void *fault_rip = (void *) si->si_addr;
-    void *fault_addr = get_fault_addr((uint8_t*)fault_rip, &op_len, uc);
-    uint8_t *fault_ptr = (uint8_t *) fault_addr;
+    uint8_t *fx = (uint8_t *) uc->uc_mcontext.fpregs;
+    uint32_t magic, xstate_size;
+    uint64_t xfeatures;
+
+    memcpy(&magic, fx + XSTATE_SW_BYTES, 4);
+    memcpy(&xfeatures, fx + XSTATE_SW_BYTES + 8, 8);
+    memcpy(&xstate_size, fx + XSTATE_SW_BYTES + 16, 4);
+    if(magic != XSTATE_MAGIC1 || (xfeatures & (1ULL << c)) == 0) return NULL;
+    if(xstate_off[c] == 0 || xstate_off[c] + size > xstate_size) return NULL;
+    return fx + xstate_off[c];
+}
 
-    //fprintf(stderr, "Exception caught: fault_addr: %p\n", fault_addr);
-    //fflush(stderr);
+static inline uint64_t* xstate_bv(ucontext_t *uc)
+{
+    return (uint64_t *) ((uint8_t *) uc->uc_mcontext.fpregs + XSTATE_HEADER);
+}
 
-    //If our decoder fails
-    if(fault_addr == NULL) {
-        //Damn we got a SIGFPE from a non vaddss. Let's disassemble and skip the fault
-#if COUNT_EXCEPTIONS == 1
-        except_cnt_underflow++;
-#endif
-        op_len = get_ins_len_and_re_execute(fault_rip, uc);
-        goto false_positive;
+// ymm r as the program left it; the upper half is 0 in the initial state
+static void read_ymm(ucontext_t *uc, int r, FpVec *v)
+{
+    uint8_t *hi = xstate_comp(uc, XSTATE_YMM, 256);
+
+    memcpy(v->b, &uc->uc_mcontext.fpregs->_xmm[r], 16);
+    if(hi != NULL && (*xstate_bv(uc) & (1 << XSTATE_YMM))) memcpy(v->b + 16, hi + 16*r, 16);
+    else memset(v->b + 16, 0, 16);
+}
+
+// result of a VEX instruction, len bytes wide: the rest of the register up
+// to the ZMM width is zeroed
+static void write_vex(ucontext_t *uc, int r, FpVec *v, int len)
+{
+    uint8_t *hi = xstate_comp(uc, XSTATE_YMM, 256);
+    uint8_t *zhi = xstate_comp(uc, XSTATE_ZMM, 512);
+    uint64_t *bv = xstate_bv(uc);
+
+    memcpy(&uc->uc_mcontext.fpregs->_xmm[r], v->b, 16);
+    // no YMM state saved: no upper halves either
+    if(hi == NULL) return;
+    if(len == 32 && (*bv & (1 << XSTATE_YMM)) == 0) {
+        // the component was in its initial state, its bytes are stale
+        memset(hi, 0, 256);
+        *bv |= 1 << XSTATE_YMM;
     }
-    
+    if(*bv & (1 << XSTATE_YMM)) {
+        if(len == 32) memcpy(hi + 16*r, v->b + 16, 16);
+        else memset(hi + 16*r, 0, 16);
+    }
+    if(zhi != NULL && (*bv & (1 << XSTATE_ZMM))) memset(zhi + 32*r, 0, 32);
+}
+
+// out = x op y, or an FMA of x, y and z, on n elements; not inlined, to keep
+// the operations between the MXCSR updates of the caller
+static void __attribute__((noinline)) fp_compute(int op, int dbl, int n, FpVec *x, FpVec *y, FpVec *z, FpVec *out)
+{
+    for(int i = 0; i < n; i++) {
+        if(dbl) {
+            double a = x->d[i], b = y->d[i], c = z->d[i];
+            switch(op) {
+                case 0x58: out->d[i] = a + b; break;
+                case 0x59: out->d[i] = a * b; break;
+                case 0x5c: out->d[i] = a - b; break;
+                case 0x5e: out->d[i] = a / b; break;
+                default: out->d[i] = fma(op & FMA_NEG_MUL ? -a : a, b, op & FMA_NEG_ADD ? -c : c);
+            }
+        }
+        else {
+            float a = x->f[i], b = y->f[i], c = z->f[i];
+            switch(op) {
+                case 0x58: out->f[i] = a + b; break;
+                case 0x59: out->f[i] = a * b; break;
+                case 0x5c: out->f[i] = a - b; break;
+                case 0x5e: out->f[i] = a / b; break;
+                default: out->f[i] = fmaf(op & FMA_NEG_MUL ? -a : a, b, op & FMA_NEG_ADD ? -c : c);
+            }
+        }
+    }
+}
+
+/*  emulate_fp: execute the FP instruction at op on the registers in uc.
+Return:
+- length of the instruction, to skip it
+- 0 if the instruction is not supported (nothing was changed)
+ */
+int emulate_fp(uint8_t *op, ucontext_t *uc)
+{
+    FpInsn in;
+    int fp_op, dbl, scalar, size;
+    FpVec d, s1, s2, out, *x, *y, *z;
+    unsigned csr;
+
+    if(decode_fp(op, uc, &in) == 0 || in.vex == 2) return 0;
+    if(in.mod != 3 && in.addr == NULL) return 0;
+    // upper halves to read and zero
+    if(in.vex && xstate_comp(uc, XSTATE_YMM, 256) == NULL) return 0;
+
+    if(in.map == 1 && (in.opc == 0x58 || in.opc == 0x59 || in.opc == 0x5c || in.opc == 0x5e)) {
+        // ps, pd (66), ss (f3), sd (f2)
+        fp_op = in.opc;
+        dbl = in.pp & 1;
+        scalar = in.pp >= 2;
+    }
+    else if(in.vex && in.map == 2 && in.pp == 1 && in.opc >= 0x98 && in.opc <= 0xbf && (in.opc & 0xf) >= 8) {
+        // vfmadd, vfmsub, vfnmadd, vfnmsub; the odd ones are scalar
+        fp_op = FMA_OP | (((in.opc & 0xf) - 8) >> 1);
+        dbl = in.w;
+        scalar = in.opc & 1;
+    }
+    else return 0;
+
+    size = scalar ? (dbl ? 8 : 4) : (in.vex ? 16 << in.l : 16);
+    read_ymm(uc, in.reg, &d);
+    if(in.vex) read_ymm(uc, in.vvvv, &s1);
+    if(in.mod != 3) {
+        memset(&s2, 0, sizeof(s2));
+        memcpy(s2.b, in.addr, size);
+    }
+    else read_ymm(uc, in.rm, &s2);
+
+    if(fp_op & FMA_OP) {
+        // 132: d*s2+s1, 213: s1*d+s2, 231: s1*s2+d
+        switch(in.opc >> 4) {
+            case 0x9: x = &d; y = &s2; z = &s1; break;
+            case 0xa: x = &s1; y = &d; z = &s2; break;
+            default: x = &s1; y = &s2; z = &d;
+        }
+        out = d;
+    }
+    else {
+        x = in.vex ? &s1 : &d;
+        y = &s2;
+        z = &s2;
+        out = *x;
+    }
+
+    csr = _mm_getcsr();
+    _mm_setcsr((uc->uc_mcontext.fpregs->mxcsr & ~_MM_FLUSH_ZERO_ON) | _MM_MASK_MASK);
+    fp_compute(fp_op, dbl, size / (dbl ? 8 : 4), x, y, z, &out);
+    _mm_setcsr(csr);
+
+    if(in.vex) write_vex(uc, in.reg, &out, scalar ? 16 : 16 << in.l);
+    else memcpy(&uc->uc_mcontext.fpregs->_xmm[in.reg], out.b, 16);
+    return in.len;
+}
+
+#if ENABLE_EXCEPTIONS == 1
+// Everything the SIGFPE handler needs, set up before the first trap: it may
+// run on several threads at once
+static void handler_init()
+{
+    unsigned eax, ebx, ecx, edx;
+
+#ifdef LIBXED_SO
+    xed_init();
+#endif
+    if(__get_cpuid_count(0xd, XSTATE_YMM, &eax, &ebx, &ecx, &edx)) xstate_off[XSTATE_YMM] = ebx;
+    if(__get_cpuid_count(0xd, XSTATE_ZMM, &eax, &ebx, &ecx, &edx)) xstate_off[XSTATE_ZMM] = ebx;
+    if(pthread_key_create(&stub_key, stubs_release) == 0) stub_key_safe = stub_key < STUB_KEY_FIRST_BLOCK;
+    pthread_atfork(NULL, NULL, stubs_atfork_child);
+}
+#endif
+
+// Does the poison at fault_ptr belong to a redzone, or is it data that
+// happens to look like one?
+static int is_redzone(uint8_t *fault_ptr)
+{
     //Probably useless
     if( (*(uint32_t *)fault_ptr) != FLOAT_MAGIC_POISON && 
-        (*(uint32_t *)fault_ptr) != FLOAT_MAGIC_POISON_PRE) goto false_positive;
+        (*(uint32_t *)fault_ptr) != FLOAT_MAGIC_POISON_PRE) return 0;
 
     uint8_t *ptr = fault_ptr;
 
     // New Improved Addition: if the fault value is 0x8b8b8b89, we should scan right to confirm a redzone
     // not left, since the 89 has to mark the start of a redzone (this way we avoid reading a prepended underflow zone)
     if(*((uint32_t *)fault_ptr) == FLOAT_MAGIC_POISON_PRE){ // i = {0,1,2,3} == {89 8b 8b 8b}
-        int found = 0;
         for(int i = 4; i < REDZONE_SIZE; i++){
             if(*(ptr+i) != FLOAT_MAGIC_POISON_BYTE){
                 // the right of a 0x898b8b8b8b is not a redzone (no 8b)
 #if COUNT_EXCEPTIONS == 1
                 except_cnt_vaddss_skip++;
 #endif
-                goto false_positive;
+                return 0;
             }
         }
     }
@@ -1101,10 +3804,8 @@ void handler(int sig, siginfo_t* si, void* vcontext)
         //if it is not 89 false positive
         //also make sure we have at least 15 8b on the right
 
-        int found = 0;
         while(*ptr == FLOAT_MAGIC_POISON_BYTE) { 
             ptr--;
-            found++;
         }
 
         //Now ptr pointing to something that is not 8b
@@ -1115,45 +3816,94 @@ void handler(int sig, siginfo_t* si, void* vcontext)
 #if COUNT_EXCEPTIONS == 1
                     except_cnt_vaddss_skip++;
 #endif
-                    goto false_positive;
+                    return 0;
                 }
             }
         } else {
 #if COUNT_EXCEPTIONS == 1
             except_cnt_vaddss_skip++;
 #endif
-            goto false_positive;
+            return 0;
         }
     }
 
-    // fault
 #if COUNT_EXCEPTIONS == 1
     except_cnt_vaddss_rz++;
 #endif
+    return 1;
+}
+
+// Print the redzone around fault_addr and the backtrace, without the
+// innermost `skip` frames (the runtime's own), and stop the program
+static inline __attribute__((always_inline)) void report_fault(void *fault_addr, void *fault_rip, int skip)
+{
+    uint8_t *fault_ptr = (uint8_t *) fault_addr;
+    uint8_t *freed = index_freed((uintptr_t)fault_ptr >> 12);
 
-#if SURVIVE_EXCEPTIONS == 0
     fprintf(stderr, "\n!!!! [FLOATZONE] Fault addr = %p !!!!\n", fault_addr);
 
-    for(int i=-64; i<64; i+=4) {
-        fprintf(stderr, "%p: %02x %02x %02x %02x ", &fault_ptr[i], fault_ptr[i], fault_ptr[i+1], fault_ptr[i+2], fault_ptr[i+3]);
-        if((void *)&fault_ptr[i] == fault_addr) fprintf(stderr, " <-----");
-        fprintf(stderr, "\n");
+    if(freed != NULL) {
+        // nothing to dump: the page is inaccessible
+        fprintf(stderr, "Use after free in the quarantined chunk at %p\n", freed);
+    }
+    else {
+        // stay on the fault's page: its neighbours may be unmapped or PROT_NONE
+        int offset = (uintptr_t)fault_ptr & 4095;
+        int first = offset < 64 ? -(offset & ~3) : -64;
+        for(int i=first; i<64 && offset+i+4 <= 4096; i+=4) {
+            fprintf(stderr, "%p: %02x %02x %02x %02x ", &fault_ptr[i], fault_ptr[i], fault_ptr[i+1], fault_ptr[i+2], fault_ptr[i+3]);
+            if((void *)&fault_ptr[i] == fault_addr) fprintf(stderr, " <-----");
+            fprintf(stderr, "\n");
+        }
     }
     fprintf(stderr, "\n");
 
-    void **buf = malloc(128*sizeof(void *));
-    int ret = backtrace(buf, 128);
-    char **names = backtrace_symbols(buf, ret);
-    fprintf(stderr, "Fault RIP = %p\nBacktrace:\n", fault_rip);
-    for(int i=2; i<ret; i++) {
-        fprintf(stderr, " - [%d] %s\n", i-2, names[i]);
-    }
+    fprintf(stderr, "Fault RIP = %p\n", fault_rip);
+    report_backtrace(skip);
+}
 
-#if FUZZ_MODE == 1
-    abort();
-#else
-    exit(FAULT_ERROR_CODE);
+#if CHECK_CMP == 1
+// the redzone compare of fpadd_magic() matched
+static void __attribute__((noinline, cold)) cmp_fault(uint8_t *ptr)
+{
+    if(!is_redzone(ptr)) return;
+#if SURVIVE_EXCEPTIONS == 0
+    report_fault(ptr, __builtin_return_address(0), 1);
+#endif
+}
+#endif
+
+void handler(int sig, siginfo_t* si, void* vcontext)
+{
+    int op_len;
+    ucontext_t *uc = (ucontext_t *)vcontext;
+    void *fault_rip = (void *) si->si_addr;
+    void *fault_addr = get_fault_addr((uint8_t*)fault_rip, &op_len, uc);
+
+    //fprintf(stderr, "Exception caught: fault_addr: %p\n", fault_addr);
+    //fflush(stderr);
+
+    //If our decoder fails
+    if(fault_addr == NULL) {
+        //Damn we got a SIGFPE from a non vaddss. Let's disassemble and skip the fault
+#if COUNT_EXCEPTIONS == 1
+        except_cnt_underflow++;
 #endif
+        op_len = emulate_fp((uint8_t*)fault_rip, uc);
+        if(op_len == 0) op_len = get_ins_len_and_re_execute(fault_rip, uc);
+        goto false_positive;
+    }
+
+    if(!is_redzone((uint8_t *) fault_addr)) {
+        //An add of the program that underflowed: it still needs its result
+        if(emulate_fp((uint8_t*)fault_rip, uc) == 0) get_ins_len_and_re_execute(fault_rip, uc);
+        goto false_positive;
+    }
+
+    // fault
+#if SURVIVE_EXCEPTIONS == 0
+    // skip the handler and the signal trampoline
+    report_fault(fault_addr, fault_rip, 2);
 #endif
 
 false_positive:
@@ -1171,15 +3921,131 @@ false_positive:
     return;
 }
 
-#if CATCH_SEGFAULT == 1
+#if ENABLE_QUARANTINE == 1 || CATCH_SEGFAULT == 1
+// A use-after-free into the inaccessible pages of a big quarantined chunk
+// (see poison_chunk()) is reported as any other fault. Other segfaults are
+// the program's own: with CATCH_SEGFAULT they stop it, otherwise they fault
+// again with the default action.
 static void segfault_handler(int sig, siginfo_t *si, void *vcontext){
+    ucontext_t *uc = (ucontext_t *)vcontext;
+
+    if(si->si_code == SEGV_ACCERR && index_freed((uintptr_t)si->si_addr >> 12) != NULL) {
+        // skip the handler and the signal trampoline
+        report_fault(si->si_addr, (void *) uc->uc_mcontext.gregs[REG_RIP], 2);
+    }
+#if CATCH_SEGFAULT == 1
 #if FUZZ_MODE == 1
     abort();
 #else
     exit(FAULT_ERROR_CODE);
 #endif
+#else
+    struct sigaction action;
+    memset(&action, 0, sizeof(struct sigaction));
+    action.sa_handler = SIG_DFL;
+    sigaction(SIGSEGV, &action, NULL);
+#endif
+}
+#endif
+
+/*
+Runtime options, read once at startup from the environment:
+  FLOATZONE_OPTIONS="quarantine_bytes=64M:quarantine_hugepages=1"
+Sizes accept K/M/G suffixes.
+ - quarantine_bytes:     quarantine budget in bytes (default 256M), split
+                         40/40/20 between the small/medium/large tiers
+ - quarantine_entries:   max entries per thread's ring of each tier (default:
+                         enough for the tier filled with its smallest chunks)
+ - quarantine_hugepages: back the rings with transparent huge pages
+ - quarantine_adaptive:  follow cgroup limits and memory pressure, see
+                         quarantine_adapt() (between quarantine_min_bytes,
+                         default 16M, and quarantine_max_bytes, default
+                         quarantine_bytes, every quarantine_adapt_ms)
+ - slab:                 serve requests up to 1K from the slab allocator
+ - backend:              allocator under the redzones: glibc (default),
+                         jemalloc, mimalloc or tcmalloc
+ - sample_rate:          instrument 1 in sample_rate allocations (default 1:
+                         all of them), the rest only get a header
+ - sample_sites:         sample 1 in sample_rate call sites instead
+ - sample_min_bytes,
+   sample_max_bytes:     only sample allocations of sizes in this range
+ - isa:                  widest kernels to use: sse2, avx2 or avx512 (default:
+                         the widest the CPU supports)
+*/
+static uint64_t parse_size(const char *val)
+{
+    char *end;
+    uint64_t n = strtoull(val, &end, 0);
+    switch(*end){
+        case 'g': case 'G': n <<= 10; // fallthrough
+        case 'm': case 'M': n <<= 10; // fallthrough
+        case 'k': case 'K': n <<= 10;
+    }
+    return n;
+}
+
+static void parse_option(const char *key, size_t key_len, const char *val)
+{
+#define OPTION(name) (key_len == sizeof(name)-1 && strncmp(key, name, key_len) == 0)
+    if(OPTION("slab")) slab_enabled = parse_size(val) != 0;
+    else if(OPTION("sample_rate")) sample_rate = parse_size(val), sampling = 1;
+    else if(OPTION("sample_min_bytes")) sample_min_bytes = parse_size(val), sampling = 1;
+    else if(OPTION("sample_max_bytes")) sample_max_bytes = parse_size(val), sampling = 1;
+    else if(OPTION("sample_sites")) sample_sites = parse_size(val) != 0;
+    else if(OPTION("isa")) isa_max = strncmp(val, "avx512", 6) == 0 ? ISA_AVX512 : strncmp(val, "avx2", 4) == 0 ? ISA_AVX2 : ISA_SSE2;
+    else if(OPTION("backend")) snprintf(backend_name, sizeof(backend_name), "%.*s", (int)strcspn(val, ":,"), val);
+#if ENABLE_QUARANTINE == 1
+    else if(OPTION("quarantine_bytes")) quarantine_budget = parse_size(val);
+    else if(OPTION("quarantine_entries")) quarantine_max_entries = parse_size(val);
+    else if(OPTION("quarantine_hugepages")) quarantine_hugepages = parse_size(val) != 0;
+    else if(OPTION("quarantine_adaptive")) quarantine_adaptive = parse_size(val) != 0;
+    else if(OPTION("quarantine_min_bytes")) quarantine_min_bytes = parse_size(val);
+    else if(OPTION("quarantine_max_bytes")) quarantine_max_bytes = parse_size(val);
+    else if(OPTION("quarantine_adapt_ms")) quarantine_adapt_ms = parse_size(val);
+#endif
+    else fprintf(stderr, "[FLOATZONE] unknown option '%.*s'\n", (int)key_len, key);
+#undef OPTION
 }
+
+static void parse_options()
+{
+    const char *opt = getenv("FLOATZONE_OPTIONS");
+    if(opt != NULL){
+        while(*opt != '\0'){
+            size_t len = strcspn(opt, ":,");
+            const char *eq = memchr(opt, '=', len);
+            if(eq != NULL) parse_option(opt, eq - opt, eq + 1);
+            else if(len != 0) parse_option(opt, len, "1");
+            opt += len;
+            if(*opt != '\0') opt++;
+        }
+    }
+
+    backend_init(backend_name);
+
+    sample_seed = sample_mix(((uint64_t)time(NULL) << 32) ^ getpid());
+
+#if ENABLE_QUARANTINE == 1
+    if(quarantine_budget < 0) quarantine_budget = 0;
+    if(quarantine_adaptive){
+        // start from the maximum, quarantine_adapt() only ever lowers it from there
+        if(quarantine_max_bytes <= 0) quarantine_max_bytes = quarantine_budget;
+        if(quarantine_min_bytes > quarantine_max_bytes) quarantine_min_bytes = quarantine_max_bytes;
+        if(quarantine_adapt_ms == 0) quarantine_adapt_ms = 1;
+        quarantine_budget = quarantine_max_bytes;
+        find_cgroup_dir();
+        quarantine_adapt();
+        next_adapt_ns = now_ns() + quarantine_adapt_ms*1000000ULL;
+    }
+    // room for a tier at backpressure, full of its smallest chunks
+    for(int t = 0; t < QUARANTINE_TIERS; t++){
+        size_t n = QUARANTINE_BACKPRESSURE*(quarantine_budget*tier_percent[t]/100)/tier_min_chunk[t] + 2;
+        if(quarantine_max_entries != 0 && n > quarantine_max_entries) n = quarantine_max_entries;
+        if(n < 2*QUARANTINE_EVICT_BATCH) n = 2*QUARANTINE_EVICT_BATCH;
+        tier_entries[t] = n;
+    }
 #endif
+}
 
 /// Disables the process so we don't do quarantine checking
 /// on malloc'd memory from pre-init libc/libdl.
@@ -1212,6 +4078,8 @@ int __libc_start_main(main_t main, int argc, char** ubp_av,
 #endif
 
     if(strstr(ubp_av[0], TARGET) || strstr(ubp_av[0], JULIET)){
+        parse_options();
+
         // register signal handler
         struct sigaction action;
         memset(&action, 0, sizeof(struct sigaction));
@@ -1222,20 +4090,29 @@ int __libc_start_main(main_t main, int argc, char** ubp_av,
         // enable Flush To Zero to allow Underflow
         _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
 
+        handler_init();
         ___sigaction(SIGFPE, &action, NULL);
 
         // enable FP underflow exceptions
         feenableexcept(FE_UNDERFLOW);
 #endif
 
+        if(slab_enabled) slab_init();
+
+        pick_kernels();
+
 #if ENABLE_QUARANTINE == 1
-        pthread_mutex_init(&ring_lock, NULL);
+        pthread_key_create(&shard_key, retire_shard);
+        pthread_atfork(NULL, NULL, quarantine_atfork_child);
+#if ENABLE_DRAINER == 1
+        start_drainer();
+#endif
 #endif
 
-#if CATCH_SEGFAULT == 1
+#if ENABLE_QUARANTINE == 1 || CATCH_SEGFAULT == 1
         memset(&action, 0, sizeof(struct sigaction));
         sigemptyset(&action.sa_mask);
-        action.sa_flags     = SA_NODEFER;
+        action.sa_flags     = SA_SIGINFO|SA_NODEFER;
         action.sa_sigaction = segfault_handler;
         sigaction(SIGSEGV, &action, NULL); // Segmentation fault
 #endif